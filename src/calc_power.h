@@ -28,7 +28,11 @@
 #define SRC_CALC_POWER_H_
 
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include <string>
 
 #include <czmq.h>
 #include <tntdb/connect.h>
@@ -59,6 +63,59 @@ struct db_reply{
  *              input port on the destination device.
  */
 typedef std::tuple< uint32_t, std::string, std::string, uint32_t > device_info_t;
+/**
+ * \brief Asset element with the ids of its parents.
+ */
+struct power_asset_t {
+    uint32_t    id;
+    std::string name;
+    uint16_t    type_id;
+    uint16_t    subtype_id;
+    std::string subtype_name;
+    //! status is "active"
+    bool        active;
+    //! id_parent1 .. id_parent10, the closest parent first, without NULLs
+    std::vector<uint32_t> parents;
+};
+
+/**
+ * \brief All asset elements and power links, loaded at once.
+ */
+struct power_assets_t {
+    //! id -> element (active and nonactive)
+    std::unordered_map<uint32_t, power_asset_t> elements;
+    //! power links: dest -> srcs
+    std::unordered_map<uint32_t, std::vector<uint32_t> > sources;
+    //! power links: src -> dests
+    std::unordered_map<uint32_t, std::vector<uint32_t> > destinations;
+    //! parent -> elements below it (at any level)
+    std::unordered_map<uint32_t, std::unordered_set<uint32_t> > content;
+    //! name -> id
+    std::unordered_map<std::string, uint32_t> ids;
+    //! the greatest id of elements
+    uint32_t max_id = 0;
+};
+
+/**
+ * \brief Change of one asset element announced on ASSETS stream.
+ */
+struct power_asset_change_t {
+    std::string name;
+    //! element is deleted or retired, other fields are not used
+    bool        removed;
+    uint16_t    type_id;
+    uint16_t    subtype_id;
+    std::string subtype_name;
+    //! status is "active"
+    bool        active;
+    //! names of parents, the closest parent first
+    std::vector<std::string> parents;
+    //! the change carries power links of the element
+    bool        has_sources;
+    //! names of devices powering the element
+    std::vector<std::string> sources;
+};
+
 // ===========================================================================
 // Device type check functions
 // ===========================================================================
@@ -101,6 +158,95 @@ bool is_ups (const device_info_t &device);
 // Functions that find power sources
 // ===========================================================================
 
+/**
+ * \brief Loads all asset elements and power links.
+ *
+ * There is a constant number of queries independent of the number of
+ * containers, elements are assigned to containers in memory by
+ * select_devices_total_power.
+ *
+ * \param conn - a connection to the database
+ *
+ * \return in case of success: status = 1,
+ *                             item is set to be all assets
+ *         in case of fail:    status = 0,
+ *                             errtype is set,
+ *                             errsubtype is set,
+ *                             msg is set
+ */
+db_reply <power_assets_t>
+    select_power_assets
+        (tntdb::Connection &conn);
+
+
+/**
+ * \brief For every active container of the type analyses its power
+ *        topology and returns a list of power devices that belong
+ *        to "input power".
+ *
+ * Containers are computed in parallel by the given number of threads
+ * (the calling one included), assets are only read. Exception of any
+ * of them is thrown, when all of them are finished.
+ *
+ * \param assets - assets loaded by select_power_assets
+ * \param container_type_id - persist::asset_type::RACK or DATACENTER
+ * \param threads - number of threads
+ *
+ * \return the same as select_devices_total_power_racks
+ */
+db_reply <std::map<std::string, std::vector<std::string> > >
+    select_devices_total_power
+        (const power_assets_t &assets,
+         uint16_t container_type_id,
+         size_t threads = 1);
+
+
+/**
+ * \brief The same as above, but only for the given containers.
+ *
+ * Names, which are not active containers of the type, are ignored,
+ * so the result can be empty.
+ *
+ * \param assets - assets loaded by select_power_assets
+ * \param container_type_id - persist::asset_type::RACK or DATACENTER
+ * \param containers - names of containers
+ *
+ * \return status = 1, item is set to be a map of container names
+ *                     onto its power sources
+ */
+db_reply <std::map<std::string, std::vector<std::string> > >
+    select_devices_total_power
+        (const power_assets_t &assets,
+         uint16_t container_type_id,
+         const std::set<std::string> &containers);
+
+
+/**
+ * \brief Applies change of one asset element to assets in memory.
+ *
+ * Names of containers, which power sources can differ after the change,
+ * are added to containers. Only these containers need to be computed
+ * again by select_devices_total_power.
+ *
+ * Change is not resolved locally, if it refers to an unknown parent or
+ * power source, changes a device to other element or back, moves or
+ * removes a container with some content (changes of the content are not
+ * announced) or updates a powered device without its power links. Assets
+ * are not changed then, they should be loaded again.
+ *
+ * \param assets - assets loaded by select_power_assets
+ * \param change - the change
+ * \param containers - names of affected containers are added here
+ *
+ * \return true if the change was applied
+ */
+bool
+    apply_power_asset_change
+        (power_assets_t &assets,
+         const power_asset_change_t &change,
+         std::set<std::string> &containers);
+
+
 /**
  * \brief For every rack analyses its power topology and
  *        for each rack returns a list of power devices
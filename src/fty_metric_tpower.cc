@@ -37,8 +37,20 @@ void usage ()
 {
     puts ("fty-metric-tpower [options]\n"
           "  -v|--verbose          verbose test output\n"
+          "  -s|--shards N         aggregate racks and DCs in N worker threads\n"
           "  -h|--help             print this information\n"
-          "Environment variables for parameters are BIOS_LOG_LEVEL.\n"
+          "Environment variables for parameters are BIOS_LOG_LEVEL,\n"
+          "BIOS_TPOWER_RCVHWM and BIOS_TPOWER_SNDHWM (receive and send\n"
+          "high-water marks of all sockets) and BIOS_TPOWER_PER_UNIT=1\n"
+          "(publish all totals of a unit in one message totals@<unit>),\n"
+          "BIOS_TPOWER_RACK_POLICY and BIOS_TPOWER_DC_POLICY (when totals\n"
+          "are published, [quantity=]absolute[:relative[:maxSilence]],...\n"
+          "for example 1:0.01:300,realpower.default=5 means 1W and 1% change\n"
+          "or 300s, for realpower.default 5W and 1% or 300s),\n"
+          "BIOS_TPOWER_TOPOLOGY_THREADS (threads computing the power topology,\n"
+          "default is number of CPUs) and BIOS_TPOWER_BATCHING_WINDOW (changed\n"
+          "racks and DCs are computed at most once per so many ms, default\n"
+          "is 100, 0 means immediately).\n"
           "Command line option takes precedence over variable.");
 }
 
@@ -46,6 +58,7 @@ int main (int argc, char *argv [])
 {
     int verbose = 0;
     int help = 0;
+    int shards = 1;
 
     // get options
     int c;
@@ -54,11 +67,12 @@ int main (int argc, char *argv [])
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wwrite-strings"
 #endif
-    static const char *short_options = "hv";
+    static const char *short_options = "hvs:";
     static struct option long_options[] =
     {
         {"help",       no_argument,       &help,    1},
         {"verbose",    no_argument,       &verbose, 1},
+        {"shards",     required_argument, 0,        's'},
         {NULL, 0, 0, 0}
     };
 #if defined(__GNUC__) || defined(__GNUG__)
@@ -75,6 +89,9 @@ int main (int argc, char *argv [])
             case 'v':
                 verbose = 1;
                 break;
+            case 's':
+                shards = atoi (optarg);
+                break;
             case 0:
                 // just now walking trough some long opt
                 break;
@@ -92,6 +109,13 @@ int main (int argc, char *argv [])
     ManageFtyLog::setInstanceFtylog(TPOWER_AGENT, FTY_COMMON_LOGGING_DEFAULT_CFG);
     log_info ("fty_metric_tpower STARTED");
 
+    // high-water marks are process-wide defaults, they are set before any
+    // actor or malamute client creates its sockets
+    int rcvhwm = tpower_env_int ("BIOS_TPOWER_RCVHWM", TPOWER_CONSUMER_RCVHWM);
+    int sndhwm = tpower_env_int ("BIOS_TPOWER_SNDHWM", TPOWER_PRODUCER_SNDHWM);
+    log_info ("rcvhwm = %d, sndhwm = %d", rcvhwm, sndhwm);
+    tpower_set_hwm (sndhwm, rcvhwm);
+
     zactor_t *tpower_server = zactor_new (fty_metric_tpower_server, const_cast<char *>(MLM_ENDPOINT));
     if ( !tpower_server ) {
         log_error ("cannot start the daemon");
@@ -101,6 +125,9 @@ int main (int argc, char *argv [])
     if (verbose) {
         ManageFtyLog::getInstanceFtylog()->setVeboseMode();
     }
+    if (shards > 1) {
+        zstr_sendx (tpower_server, "SHARDS", std::to_string (shards).c_str (), NULL);
+    }
     //  Accept and print any message back from server
     //  copy from src/malamute.c under MPL license
     while (!zsys_interrupted) {
@@ -39,6 +39,10 @@
 typedef struct _metricinfo_t metricinfo_t;
 #define METRICINFO_T_DEFINED
 #endif
+#ifndef METRICFRAME_T_DEFINED
+typedef struct _metricframe_t metricframe_t;
+#define METRICFRAME_T_DEFINED
+#endif
 #ifndef CALC_POWER_T_DEFINED
 typedef struct _calc_power_t calc_power_t;
 #define CALC_POWER_T_DEFINED
@@ -47,14 +51,34 @@ typedef struct _calc_power_t calc_power_t;
 typedef struct _tpowerconfiguration_t tpowerconfiguration_t;
 #define TPOWERCONFIGURATION_T_DEFINED
 #endif
+#ifndef TPOWERSHARDS_T_DEFINED
+typedef struct _tpowershards_t tpowershards_t;
+#define TPOWERSHARDS_T_DEFINED
+#endif
+#ifndef TPOWERPUBLISHER_T_DEFINED
+typedef struct _tpowerpublisher_t tpowerpublisher_t;
+#define TPOWERPUBLISHER_T_DEFINED
+#endif
 #ifndef METRICLIST_T_DEFINED
 typedef struct _metriclist_t metriclist_t;
 #define METRICLIST_T_DEFINED
 #endif
+#ifndef QUANTITY_T_DEFINED
+typedef struct _quantity_t quantity_t;
+#define QUANTITY_T_DEFINED
+#endif
 #ifndef TP_UNIT_T_DEFINED
 typedef struct _tp_unit_t tp_unit_t;
 #define TP_UNIT_T_DEFINED
 #endif
+#ifndef TPOWERREDUCE_T_DEFINED
+typedef struct _tpowerreduce_t tpowerreduce_t;
+#define TPOWERREDUCE_T_DEFINED
+#endif
+#ifndef SYMBOLTABLE_T_DEFINED
+typedef struct _symboltable_t symboltable_t;
+#define SYMBOLTABLE_T_DEFINED
+#endif
 #ifndef WATCHDOG_T_DEFINED
 typedef struct _watchdog_t watchdog_t;
 #define WATCHDOG_T_DEFINED
@@ -64,10 +88,16 @@ typedef struct _watchdog_t watchdog_t;
 
 
 #include "metricinfo.h"
+#include "metricframe.h"
 #include "calc_power.h"
 #include "tpowerconfiguration.h"
+#include "tpowershards.h"
+#include "tpowerpublisher.h"
 #include "metriclist.h"
+#include "quantity.h"
 #include "tp_unit.h"
+#include "tpowerreduce.h"
+#include "symboltable.h"
 #include "watchdog.h"
 
 //  *** To avoid double-definitions, only define if building without draft ***
@@ -78,6 +108,11 @@ typedef struct _watchdog_t watchdog_t;
 FTY_METRIC_TPOWER_PRIVATE void
     metricinfo_test (bool verbose);
 
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_TPOWER_PRIVATE void
+    metricframe_test (bool verbose);
+
 //  *** Draft method, defined for internal use only ***
 //  Self test of this class.
 FTY_METRIC_TPOWER_PRIVATE void
@@ -88,16 +123,41 @@ FTY_METRIC_TPOWER_PRIVATE void
 FTY_METRIC_TPOWER_PRIVATE void
     tpowerconfiguration_test (bool verbose);
 
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_TPOWER_PRIVATE void
+    tpowershards_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_TPOWER_PRIVATE void
+    tpowerpublisher_test (bool verbose);
+
 //  *** Draft method, defined for internal use only ***
 //  Self test of this class.
 FTY_METRIC_TPOWER_PRIVATE void
     metriclist_test (bool verbose);
 
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_TPOWER_PRIVATE void
+    quantity_test (bool verbose);
+
 //  *** Draft method, defined for internal use only ***
 //  Self test of this class.
 FTY_METRIC_TPOWER_PRIVATE void
     tp_unit_test (bool verbose);
 
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_TPOWER_PRIVATE void
+    tpowerreduce_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+FTY_METRIC_TPOWER_PRIVATE void
+    symboltable_test (bool verbose);
+
 //  Self test for private classes
 FTY_METRIC_TPOWER_PRIVATE void
     fty_metric_tpower_private_selftest (bool verbose, const char *subtest);
@@ -40,14 +40,26 @@ fty_metric_tpower_private_selftest (bool verbose, const char *subtest)
 // Tests for stable private classes:
     if (streq (subtest, "$ALL") || streq (subtest, "metricinfo_test"))
         metricinfo_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "metricframe_test"))
+        metricframe_test (verbose);
     if (streq (subtest, "$ALL") || streq (subtest, "calc_power_test"))
         calc_power_test (verbose);
     if (streq (subtest, "$ALL") || streq (subtest, "tpowerconfiguration_test"))
         tpowerconfiguration_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "tpowershards_test"))
+        tpowershards_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "tpowerpublisher_test"))
+        tpowerpublisher_test (verbose);
     if (streq (subtest, "$ALL") || streq (subtest, "metriclist_test"))
         metriclist_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "quantity_test"))
+        quantity_test (verbose);
     if (streq (subtest, "$ALL") || streq (subtest, "tp_unit_test"))
         tp_unit_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "tpowerreduce_test"))
+        tpowerreduce_test (verbose);
+    if (streq (subtest, "$ALL") || streq (subtest, "symboltable_test"))
+        symboltable_test (verbose);
 }
 /*
 ################################################################################
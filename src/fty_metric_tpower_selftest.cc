@@ -45,10 +45,16 @@ all_tests [] = {
 // Tests for stable/draft private classes:
 // Now built only with --enable-drafts, so even stable builds are hidden behind the flag
     { "metricinfo", NULL, true, false, "metricinfo_test" },
+    { "metricframe", NULL, true, false, "metricframe_test" },
     { "calc_power", NULL, true, false, "calc_power_test" },
     { "tpowerconfiguration", NULL, true, false, "tpowerconfiguration_test" },
+    { "tpowershards", NULL, true, false, "tpowershards_test" },
+    { "tpowerpublisher", NULL, true, false, "tpowerpublisher_test" },
     { "metriclist", NULL, true, false, "metriclist_test" },
+    { "quantity", NULL, true, false, "quantity_test" },
     { "tp_unit", NULL, true, false, "tp_unit_test" },
+    { "tpowerreduce", NULL, true, false, "tpowerreduce_test" },
+    { "symboltable", NULL, true, false, "symboltable_test" },
     { "private_classes", NULL, false, false, "$ALL" }, // compat option for older projects
 #endif // FTY_METRIC_TPOWER_BUILD_DRAFT_API
     {NULL, NULL, 0, 0, NULL}          //  Sentinel
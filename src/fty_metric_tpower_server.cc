@@ -31,24 +31,33 @@ static const char *AGENT_NAME = "agent-tpower";
 
 #include "fty_metric_tpower_classes.h"
 #include <string>
+#include <set>
+#include <array>
+#include <memory>
+#include <inttypes.h>
 #include <fty_common_mlm_guards.h>
 
+// maximal number of messages processed before timers are checked
+static const size_t DRAIN_BUDGET = 256;
+
 // ============================================================
 //         Functionality for METRIC processing and publishing
 // ============================================================
 bool send_metrics (mlm_client_t* client, const MetricInfo &M){
-    log_trace ("Metric is sent: topic = %s, time = %s, value = %s",
-        M.generateTopic().c_str(), std::to_string(M.getTimestamp()).c_str(),
-        std::to_string(M.getValue()).c_str());
+    std::string topic = M.generateTopic();
+    char value [32];
+    formatValue (M.getValue(), value, sizeof (value));
+    log_trace ("Metric is sent: topic = %s, time = %" PRIu64 ", value = %s",
+        topic.c_str(), M.getTimestamp(), value);
     zmsg_t *msg = fty_proto_encode_metric (
             NULL,
             ::time (NULL),
             M.getTtl (),
             M.getSource().c_str(),
             M.getElementName().c_str(),
-            std::to_string(M.getValue()).c_str(),
+            value,
             M.getUnits().c_str());
-    int r = mlm_client_send (client, M.generateTopic().c_str(), &msg);
+    int r = mlm_client_send (client, topic.c_str(), &msg);
     if ( r == -1 ) {
         return false;
     }
@@ -60,7 +69,26 @@ bool send_metrics (mlm_client_t* client, const MetricInfo &M){
 static void
     s_processMetric(
         TotalPowerConfiguration &config,
-        const std::string &topic,
+        const char *topic,
+        const MetricFrame &frame)
+{
+    double dvalue;
+    if (!frame.parseValue (dvalue)) {
+        log_info ("cannot convert value '%.*s' to double, ignore message\n",
+                  static_cast<int> (frame.value.size), frame.value.data);
+        return;
+    }
+
+    log_trace("Got message '%s' with value %.*s\n", topic,
+              static_cast<int> (frame.value.size), frame.value.data);
+
+    config.processMetric (frame.toMetricInfo (dvalue), topic);
+}
+
+static void
+    s_processMetric(
+        TotalPowerConfiguration &config,
+        const char *topic,
         fty_proto_t **bmessage_p)
 {
     fty_proto_t *bmessage = *bmessage_p;
@@ -85,12 +113,155 @@ static void
     uint32_t ttl = fty_proto_ttl(bmessage);
     uint64_t timestamp = fty_proto_time (bmessage);
 
-    log_trace("Got message '%s' with value %s\n", topic.c_str(), value);
+    log_trace("Got message '%s' with value %s\n", topic, value);
 
-    MetricInfo m (element_src, type, unit, dvalue, timestamp, "", ttl);
+    SymbolTable &symbols = SymbolTable::instance();
+    MetricInfo m (symbols.intern (element_src), symbols.intern (type),
+                  symbols.intern (unit), dvalue, timestamp, ttl);
     config.processMetric (m, topic);
 }
 
+// Subscribe realpower metrics of powerdevices, which are new in topology.
+// Malamute can't drop consumer pattern of a connected client, so metrics of
+// removed powerdevices are still delivered and dropped by isInteresting().
+static void
+    s_subscribe (
+        mlm_client_t *client,
+        const TotalPowerConfiguration &config,
+        std::set<std::string> &subscribed)
+{
+    for (const auto &pattern : config.subscriptions ()) {
+        if (subscribed.count (pattern)) {
+            continue;
+        }
+        if (mlm_client_set_consumer (client, FTY_PROTO_STREAM_METRICS, pattern.c_str ()) < 0) {
+            log_error ("%s: can't set consumer on stream '%s', '%s'",
+                    AGENT_NAME, FTY_PROTO_STREAM_METRICS, pattern.c_str ());
+            continue;
+        }
+        subscribed.insert (pattern);
+    }
+    log_info ("consuming metrics of %zu powerdevices", subscribed.size ());
+}
+
+
+// Publish policies of racks and DCs from environment, see parsePolicies()
+static TPowerPublishPolicies
+    s_envPolicies (void)
+{
+    TPowerPublishPolicies policies;
+    const char *racks = getenv ("BIOS_TPOWER_RACK_POLICY");
+    if (racks && !TotalPowerConfiguration::parsePolicies (racks, policies.racks)) {
+        log_warning ("ignoring BIOS_TPOWER_RACK_POLICY='%s'", racks);
+    }
+    const char *dcs = getenv ("BIOS_TPOWER_DC_POLICY");
+    if (dcs && !TotalPowerConfiguration::parsePolicies (dcs, policies.DCs)) {
+        log_warning ("ignoring BIOS_TPOWER_DC_POLICY='%s'", dcs);
+    }
+    return policies;
+}
+
+// Distribution of number of messages drained from malamute at once
+struct DrainStats {
+    // bucket i counts batches of size 2^i .. 2^(i+1)-1
+    std::array<uint64_t, 16> batches {};
+    uint64_t messages = 0;
+
+    void add (size_t size) {
+        if (size == 0) {
+            return;
+        }
+        size_t bucket = 0;
+        while ((size >> (bucket + 1)) && bucket + 1 < batches.size ()) {
+            ++bucket;
+        }
+        ++batches[bucket];
+        messages += size;
+    }
+
+    std::string toString () const {
+        std::string result = "messages=" + std::to_string (messages) + " batches=";
+        for (size_t i = 0; i < batches.size (); ++i) {
+            if (batches[i]) {
+                result += std::to_string (1u << i) + ":" + std::to_string (batches[i]) + ",";
+            }
+        }
+        if (result.back () == ',') {
+            result.pop_back ();
+        }
+        return result;
+    }
+};
+
+// Process one message received from malamute
+static void
+    s_processMessage (
+        mlm_client_t *client,
+        TotalPowerConfiguration &tpower_conf,
+        Watchdog &watchdog,
+        zmsg_t **zmessage_p)
+{
+    zmsg_t *zmessage = *zmessage_p;
+    *zmessage_p = NULL;
+    const char *topic = mlm_client_subject(client);
+    log_trace("Got message '%s'", topic);
+    // What is going on???
+    //
+    // Listen on metrics +
+    // Listen on assets
+    //
+    // Produce metrics +
+    //
+    // Current iplementation: read topology from DB
+    // TODO: move it to asset agent and receive this info
+    // as message
+
+
+    // metrics of powerdevices out of topology are dropped before decoding
+    if (streq (mlm_client_address (client), FTY_PROTO_STREAM_METRICS) &&
+        !tpower_conf.isInteresting (topic))
+    {
+        watchdog.tick();
+        zmsg_destroy (&zmessage);
+        return;
+    }
+
+    if (is_fty_proto (zmessage)) {
+        // metrics are read directly from the frame
+        MetricFrame frame;
+        if (frame.decode (zmessage)) {
+            watchdog.tick();
+            s_processMetric (tpower_conf, topic, frame);
+            zmsg_destroy (&zmessage);
+            return;
+        }
+        fty_proto_t *bmessage = fty_proto_decode (&zmessage);
+        if (!bmessage) {
+            log_error ("cannot decode fty_proto message, ignore it");
+            return;
+        }
+        // As long as we are receiving metrics from malamute, everything
+        // is fine
+        watchdog.tick();
+        if (fty_proto_id (bmessage) == FTY_PROTO_METRIC)  {
+            s_processMetric (tpower_conf, topic, &bmessage);
+        }
+        else if (fty_proto_id (bmessage) == FTY_PROTO_ASSET)  {
+            tpower_conf.processAsset(bmessage);
+        }
+        else {
+            log_error ("it is not an alert message, ignore it");
+        }
+        fty_proto_destroy (&bmessage);
+    }
+    else {
+        log_error ("not fty proto");
+    }
+
+    // listen
+    zmsg_destroy (&zmessage);
+}
+
 void
 fty_metric_tpower_server (zsock_t *pipe, void* args)
 {
@@ -103,7 +274,9 @@ fty_metric_tpower_server (zsock_t *pipe, void* args)
     // Signal need to be send as it is required by "actor_new"
     zsock_signal (pipe, 0);
 
-    MlmClientGuard client(mlm_client_new());
+    // metrics are received and published by distinct clients, so outbound
+    // pressure doesn't block the ingest, high-water marks are set by main
+    MlmClientGuard client(mlm_client_new ());
     if (!client) {
         log_error("mlm_client_new () failed");
         return;
@@ -114,18 +287,6 @@ fty_metric_tpower_server (zsock_t *pipe, void* args)
         zstr_send(pipe, "$TERM");
         return;
     }
-    if (mlm_client_set_producer(client, FTY_PROTO_STREAM_METRICS) < 0) {
-        log_error("%s: can't set producer on stream '%s'",
-                AGENT_NAME, FTY_PROTO_STREAM_METRICS);
-        zstr_send(pipe, "$TERM");
-        return;
-    }
-    if (mlm_client_set_consumer(client, FTY_PROTO_STREAM_METRICS, "^realpower.*") < 0) {
-        log_error("%s: can't set consumer on stream '%s', '%s'",
-                AGENT_NAME, FTY_PROTO_STREAM_METRICS, "^realpower.*");
-        zstr_send(pipe, "$TERM");
-        return;
-    }
     if (mlm_client_set_consumer(client, FTY_PROTO_STREAM_ASSETS, ".*") < 0) {
         log_error("%s: can't set consumer on stream '%s', '%s'",
                 AGENT_NAME, FTY_PROTO_STREAM_ASSETS, ".*");
@@ -138,24 +299,30 @@ fty_metric_tpower_server (zsock_t *pipe, void* args)
     // Such trick with function is used, because tpower_configuration
     // wants itself to control "advertise time".
     // But We want to separate logic from messaging -> use function as parameter
-    std::function<bool(const MetricInfo&)> fff= [&client] (const MetricInfo& M) -> bool {
-        return send_metrics (client, M);
+    // Metrics are sent by publisher in its own thread, which returns the
+    // metrics it failed to send.
+    // totals of one unit can be sent in one message (opt-in, not understood by existing consumers)
+    bool perUnit = tpower_env_int ("BIOS_TPOWER_PER_UNIT", 0) > 0;
+    TPowerPublisher publisher (endpoint, (std::string (AGENT_NAME) + "-publisher").c_str (), perUnit);
+    std::function<bool(const MetricInfo&)> fff= [&publisher] (const MetricInfo& M) -> bool {
+        return publisher.publish (M);
     };
     // initial set up
     TotalPowerConfiguration tpower_conf(fff);
+    tpower_conf.publishPolicies (s_envPolicies ());
+    tpower_conf.topologyThreads (tpower_env_int ("BIOS_TPOWER_TOPOLOGY_THREADS", TPOWER_TOPOLOGY_THREADS));
+    tpower_conf.batchingWindow (tpower_env_int ("BIOS_TPOWER_BATCHING_WINDOW", TPOWER_BATCHING_WINDOW));
     tpower_conf.configure();
+    // metrics are consumed only for powerdevices in topology
+    std::set<std::string> subscribed;
+    uint64_t subscribedVersion = tpower_conf.topologyVersion();
+    s_subscribe (client, tpower_conf, subscribed);
+    DrainStats stats;
+    // aggregation in worker actors, see SHARDS command
+    std::unique_ptr<TPowerShards> shards;
     uint64_t last = zclock_mono ();
     while (!zsys_interrupted) {
         void *which = zpoller_wait (poller, tpower_conf.getTimeout());
-        uint64_t now = zclock_mono();
-        if (now - last >= static_cast<uint64_t>(tpower_conf.getTimeout())) {
-            last = now;
-            log_debug("Periodic polling");
-            tpower_conf.onPoll();
-        }
-        if ( zpoller_expired (poller) ) {
-            continue;
-        }
         if ( zpoller_terminated (poller) ) {
             log_info ("poller was terminated");
             break;
@@ -171,58 +338,102 @@ fty_metric_tpower_server (zsock_t *pipe, void* args)
                 break;
             }
             else
+            if (streq (cmd, "SHARDS")) {
+                ZstrGuard count(zmsg_popstr(msg));
+                size_t n = count ? strtoul (count, NULL, 10) : 1;
+                if (shards) {
+                    for (size_t i = 0; i < shards->size (); ++i) {
+                        zpoller_remove (poller, shards->actor (i));
+                    }
+                }
+                tpower_conf.shards (NULL);
+                shards.reset (n > 1 ? new TPowerShards (n, tpower_conf.batchingWindow ()) : NULL);
+                if (shards) {
+                    for (size_t i = 0; i < shards->size (); ++i) {
+                        zpoller_add (poller, shards->actor (i));
+                    }
+                    tpower_conf.shards (shards.get ());
+                }
+                log_info ("aggregating in %zu shards", shards ? shards->size () : 0);
+                // units are recreated in the new place
+                tpower_conf.configure();
+            }
+            else
+            if (streq (cmd, "STATS")) {
+                std::string report = stats.toString ();
+                zstr_sendf (pipe, "%s accepted=%" PRIu64 " rejected=%" PRIu64
+                    " sent=%" PRIu64 " notsent=%" PRIu64 " dropped=%" PRIu64 " messages=%" PRIu64,
+                    report.c_str (), tpower_conf.acceptedMetrics (), tpower_conf.rejectedMetrics (),
+                    publisher.sent (), publisher.notSent (), publisher.rejected (), publisher.messages ());
+            }
+            else
             {
                 log_info ("unhandled command %s", cmd.get());
             }
-            continue;
         }
-
-        // This agent is a reactive agent, it reacts only on messages
-        // and doesn't do anything if there is no messages
-        zmsg_t *zmessage = mlm_client_recv (client);
-        if ( zmessage == NULL ) {
-            continue;
-        }
-        std::string topic = mlm_client_subject(client);
-        log_trace("Got message '%s'", topic.c_str());
-        // What is going on???
-        //
-        // Listen on metrics +
-        // Listen on assets
-        //
-        // Produce metrics +
-        //
-        // Current iplementation: read topology from DB
-        // TODO: move it to asset agent and receive this info
-        // as message
-
-
-        if (is_fty_proto (zmessage)) {
-            fty_proto_t *bmessage = fty_proto_decode (&zmessage);
-            if (!bmessage) {
-                log_error ("cannot decode fty_proto message, ignore it");
-                continue;
+        else
+        if (which == mlm_client_msgpipe (client)) {
+            // drain everything, what is already waiting (up to the budget),
+            // timers are checked once per batch
+            size_t batch = 0;
+            do {
+                // This agent is a reactive agent, it reacts only on messages
+                // and doesn't do anything if there is no messages
+                zmsg_t *zmessage = mlm_client_recv (client);
+                if ( zmessage == NULL ) {
+                    break;
+                }
+                s_processMessage (client, tpower_conf, watchdog, &zmessage);
+                ++batch;
+            } while (batch < DRAIN_BUDGET && !zsys_interrupted &&
+                     ( zsock_events (mlm_client_msgpipe (client)) & ZMQ_POLLIN ));
+            stats.add (batch);
+            if (shards) {
+                shards->flush ();
             }
-            // As long as we are receiving metrics from malamute, everything
-            // is fine
-            watchdog.tick();
-            if (fty_proto_id (bmessage) == FTY_PROTO_METRIC)  {
-                s_processMetric (tpower_conf, topic, &bmessage);
+        }
+
+        else
+        if (shards) {
+            // totals computed by a shard
+            std::vector<MetricInfo> published;
+            for (size_t i = 0; i < shards->size (); ++i) {
+                if (which == shards->actor (i)) {
+                    TPowerShards::receivePublished (shards->actor (i), published);
+                }
             }
-            else if (fty_proto_id (bmessage) == FTY_PROTO_ASSET)  {
-                tpower_conf.processAsset(bmessage);
+            for (const auto &M : published) {
+                if (!publisher.publish (M)) {
+                    // the shard advertises it again
+                    log_warning ("publisher queue is full, metric %s returned to shard", M.generateTopic ().c_str ());
+                    shards->notPublished (M);
+                }
             }
-            else {
-                log_error ("it is not an alert message, ignore it");
+        }
+
+        // units, which produced the metrics, are in shards in shards mode
+        MetricInfo notSent;
+        while (publisher.failed (notSent)) {
+            if (shards) {
+                shards->notPublished (notSent);
+            } else {
+                tpower_conf.notPublished (notSent);
             }
-            fty_proto_destroy (&bmessage);
         }
-        else {
-            log_error ("not fty proto");
+        if (shards) {
+            shards->flush ();
         }
 
-        // listen
-        zmsg_destroy (&zmessage);
+        uint64_t now = zclock_mono();
+        if (now - last >= static_cast<uint64_t>(tpower_conf.getTimeout())) {
+            last = now;
+            log_debug("Periodic polling");
+            tpower_conf.onPoll();
+            if (tpower_conf.topologyVersion() != subscribedVersion) {
+                subscribedVersion = tpower_conf.topologyVersion();
+                s_subscribe (client, tpower_conf, subscribed);
+            }
+        }
     }
     //TODO:  save info to persistence before I die
 }
@@ -0,0 +1,288 @@
+/*  =========================================================================
+    metricframe - Encoder and decoder of metric messages
+
+    Copyright (C) 2014 - 2018 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    metricframe - Encoder and decoder of metric messages
+@discuss
+    Fast path for the metrics, which are the majority of the traffic.
+    Anything unexpected is left to fty_proto_decode.
+    Published metrics are written from templates encoded by fty_proto.
+@end
+*/
+
+#include "fty_metric_tpower_classes.h"
+
+// Reads fields in network byte order, returns false when frame is too short
+class FrameReader {
+public:
+    FrameReader (const byte *data, size_t size) :
+        _needle (data),
+        _ceiling (data + size)
+    {};
+
+    bool number (uint64_t &result, size_t size) {
+        if (static_cast<size_t> (_ceiling - _needle) < size)
+            return false;
+        result = 0;
+        for (size_t i = 0; i < size; ++i)
+            result = (result << 8) + _needle [i];
+        _needle += size;
+        return true;
+    };
+
+    bool skip (size_t size) {
+        if (static_cast<size_t> (_ceiling - _needle) < size)
+            return false;
+        _needle += size;
+        return true;
+    };
+
+    bool string (MetricFrame::StringRef &result, size_t sizeOfSize) {
+        uint64_t size;
+        if (!number (size, sizeOfSize))
+            return false;
+        result.data = reinterpret_cast<const char *> (_needle);
+        result.size = size;
+        return skip (size);
+    };
+
+    bool atEnd (void) const {
+        return _needle == _ceiling;
+    };
+
+private:
+    const byte *_needle;
+    const byte *_ceiling;
+};
+
+
+bool MetricFrame::
+    decode (zmsg_t *msg)
+{
+    if (!msg || zmsg_size (msg) != 1)
+        return false;
+    zframe_t *frame = zmsg_first (msg);
+    FrameReader reader (zframe_data (frame), zframe_size (frame));
+
+    uint64_t id;
+    // signature was checked by is_fty_proto
+    if (!reader.skip (2) || !reader.number (id, 1) || id != FTY_PROTO_METRIC)
+        return false;
+
+    uint64_t auxSize;
+    if (!reader.number (auxSize, 4))
+        return false;
+    for (uint64_t i = 0; i < auxSize; ++i) {
+        StringRef key, value;
+        if (!reader.string (key, 1) || !reader.string (value, 4))
+            return false;
+    }
+
+    uint64_t number;
+    if (!reader.number (number, 8))
+        return false;
+    time = number;
+    if (!reader.number (number, 4))
+        return false;
+    ttl = static_cast<uint32_t> (number);
+
+    if (!reader.string (type, 1) ||
+        !reader.string (name, 1) ||
+        !reader.string (value, 1) ||
+        !reader.string (unit, 1))
+        return false;
+    // other fields mean a different version of the protocol
+    return reader.atEnd ();
+}
+
+
+bool MetricFrame::
+    parseValue (double &result) const
+{
+    // string has 1B of size, so it always fits
+    char buffer [256];
+    if (value.size == 0 || value.size >= sizeof (buffer))
+        return false;
+    memcpy (buffer, value.data, value.size);
+    buffer [value.size] = '\0';
+
+    char *end;
+    errno = 0;
+    result = strtod (buffer, &end);
+    if (errno == ERANGE || *end != '\0') {
+        errno = 0;
+        return false;
+    }
+    return true;
+}
+
+
+MetricInfo MetricFrame::
+    toMetricInfo (double dvalue) const
+{
+    SymbolTable &symbols = SymbolTable::instance ();
+    return MetricInfo (
+        symbols.intern (name.data, name.size),
+        symbols.intern (type.data, type.size),
+        symbols.intern (unit.data, unit.size),
+        dvalue, time, ttl);
+}
+
+MetricTemplate::
+    MetricTemplate (const MetricInfo &M) :
+    _topic (M.generateTopic ()),
+    _ttl (M.getTtl ()),
+    _units (M.getUnitsId ())
+{
+    zmsg_t *msg = fty_proto_encode_metric (
+        NULL, 0, static_cast<uint32_t> (_ttl),
+        M.getSource ().c_str (), M.getElementName ().c_str (), "", M.getUnits ().c_str ());
+    MetricFrame frame;
+    if (msg && frame.decode (msg)) {
+        zframe_t *encoded = zmsg_first (msg);
+        const char *data = reinterpret_cast<const char *> (zframe_data (encoded));
+        const char *end = data + zframe_size (encoded);
+        // time (8B) | ttl (4B) | size of type (1B) | type
+        _timeOffset = (frame.type.data - 1 - 4 - 8) - data;
+        // size of value (1B) | value (empty)
+        _prefix.assign (data, frame.value.data - 1);
+        _suffix.assign (frame.value.data, end);
+        _valid = true;
+    }
+    zmsg_destroy (&msg);
+}
+
+zmsg_t *MetricTemplate::
+    encode (const MetricInfo &M, uint64_t time, std::string &buffer) const
+{
+    char value [32];
+    size_t size = formatValue (M.getValue (), value, sizeof (value));
+
+    buffer.assign (_prefix);
+    for (int i = 7; i >= 0; --i) {
+        buffer [_timeOffset + 7 - i] = static_cast<char> ((time >> (8 * i)) & 0xff);
+    }
+    buffer.push_back (static_cast<char> (size));
+    buffer.append (value, size);
+    buffer.append (_suffix);
+
+    zmsg_t *msg = zmsg_new ();
+    zmsg_addmem (msg, buffer.data (), buffer.size ());
+    return msg;
+}
+
+size_t
+    formatValue (double value, char *buffer, size_t size)
+{
+    // 17 significant digits are always enough, try the shorter first
+    int length = 0;
+    for (int precision = 15; precision <= 17; ++precision) {
+        length = snprintf (buffer, size, "%.*g", precision, value);
+        if (strtod (buffer, NULL) == value) {
+            break;
+        }
+    }
+    return static_cast<size_t> (length);
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+metricframe_test (bool verbose)
+{
+    printf (" * metricframe: ");
+
+    zhash_t *aux = zhash_new ();
+    zhash_insert (aux, "port", (void *) "1");
+    zmsg_t *msg = fty_proto_encode_metric (
+        aux, 1234567890, 300, "realpower.default", "epdu-1", "42.5", "W");
+    zhash_destroy (&aux);
+    assert (is_fty_proto (msg));
+
+    MetricFrame frame;
+    assert (frame.decode (msg));
+    assert (frame.time == 1234567890);
+    assert (frame.ttl == 300);
+    assert (frame.type.size == strlen ("realpower.default"));
+    assert (memcmp (frame.type.data, "realpower.default", frame.type.size) == 0);
+    assert (frame.name.size == strlen ("epdu-1"));
+    assert (memcmp (frame.name.data, "epdu-1", frame.name.size) == 0);
+
+    double value;
+    assert (frame.parseValue (value));
+    assert (value == 42.5);
+
+    MetricInfo M = frame.toMetricInfo (value);
+    assert (M.getElementName () == "epdu-1");
+    assert (M.getSource () == "realpower.default");
+    assert (M.getUnits () == "W");
+    assert (M.getTimestamp () == 1234567890);
+    assert (M.getTtl () == 300);
+    zmsg_destroy (&msg);
+
+    // not a number
+    msg = fty_proto_encode_metric (NULL, 1, 1, "realpower.default", "epdu-1", "abc", "W");
+    assert (frame.decode (msg));
+    assert (!frame.parseValue (value));
+    zmsg_destroy (&msg);
+
+    // shortest value, which is read back the same
+    char buffer [32];
+    assert (formatValue (456.66, buffer, sizeof (buffer)) == strlen ("456.66"));
+    assert (streq (buffer, "456.66"));
+    formatValue (0.1 + 0.2, buffer, sizeof (buffer));
+    assert (strtod (buffer, NULL) == 0.1 + 0.2);
+    formatValue (100, buffer, sizeof (buffer));
+    assert (streq (buffer, "100"));
+
+    // template writes the same message as fty_proto
+    {
+        MetricInfo published ("rack-1", "realpower.default", "W", 456.66, 0, "", 360);
+        MetricTemplate metricTemplate (published);
+        assert (metricTemplate.valid ());
+        assert (metricTemplate.matches (published));
+        assert (metricTemplate.topic () == "realpower.default@rack-1");
+
+        std::string encodeBuffer;
+        zmsg_t *expected = fty_proto_encode_metric (
+            NULL, 1234567890, 360, "realpower.default", "rack-1", "456.66", "W");
+        msg = metricTemplate.encode (published, 1234567890, encodeBuffer);
+        assert (zmsg_size (msg) == 1);
+        zframe_t *a = zmsg_first (msg);
+        zframe_t *b = zmsg_first (expected);
+        assert (zframe_size (a) == zframe_size (b));
+        assert (memcmp (zframe_data (a), zframe_data (b), zframe_size (a)) == 0);
+        zmsg_destroy (&expected);
+        zmsg_destroy (&msg);
+
+        MetricInfo otherTtl ("rack-1", "realpower.default", "W", 1, 0, "", 60);
+        assert (!metricTemplate.matches (otherTtl));
+    }
+
+    // other messages are left to fty_proto_decode
+    msg = fty_proto_encode_asset (NULL, "rack-1", FTY_PROTO_ASSET_OP_UPDATE, NULL);
+    assert (!frame.decode (msg));
+    zmsg_destroy (&msg);
+
+    printf ("OK\n");
+}
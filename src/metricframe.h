@@ -0,0 +1,139 @@
+/*  =========================================================================
+    metricframe - Encoder and decoder of metric messages
+
+    Copyright (C) 2014 - 2018 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*! \file   metricframe.h
+ *  \brief  Reads and writes fty_proto METRIC message without fty_proto codec
+ */
+
+#ifndef SRC_METRICFRAME_H_
+#define SRC_METRICFRAME_H_
+
+#include <czmq.h>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#include "metricinfo.h"
+
+/*
+ * \brief Fields of fty_proto METRIC message we are interested in
+ *
+ * Strings point directly to the frame of the message, so the structure
+ * is valid only as long as the message exists. Nothing is allocated.
+ *
+ * Wire format of METRIC (see fty_proto codec):
+ *
+ *     signature (2B) | id (1B) | aux (hash) | time (8B) | ttl (4B) |
+ *     type (string) | name (string) | value (string) | unit (string)
+ *
+ * where string is 1B of size + data and hash is 4B of count + pairs of
+ * string key and long string (4B of size + data) value.
+ */
+class MetricFrame {
+public:
+
+    //! \brief string in the frame, not terminated by '\0'
+    struct StringRef {
+        const char *data;
+        size_t      size;
+    };
+
+    /*
+     * \brief Decodes the message
+     *
+     * \param[in] msg - fty_proto message (is_fty_proto() is true)
+     *
+     * \return true  - if it is METRIC and all fields were read,
+     *         false - otherwise, use fty_proto_decode() then
+     */
+    bool decode (zmsg_t *msg);
+
+    /*
+     * \brief Parses value as double
+     *
+     * \return false if value is not a number
+     */
+    bool parseValue (double &value) const;
+
+    /*
+     * \brief Creates metric, names are interned
+     */
+    MetricInfo toMetricInfo (double value) const;
+
+    uint64_t  time;
+    uint32_t  ttl;
+    StringRef type;
+    StringRef name;
+    StringRef value;
+    StringRef unit;
+};
+
+/*
+ * \brief Pre-encoded METRIC message of one unit and quantity
+ *
+ * The message is encoded by fty_proto_encode_metric once, publication only
+ * copies the parts around the time and the value into a reused buffer.
+ */
+class MetricTemplate {
+public:
+    explicit MetricTemplate (const MetricInfo &M);
+
+    //! \brief false if the message couldn't be pre-encoded, use fty_proto_encode_metric then
+    bool valid (void) const {
+        return _valid;
+    };
+
+    //! \brief template can encode the metric (ttl and units are pre-encoded)
+    bool matches (const MetricInfo &M) const {
+        return _ttl == M.getTtl () && _units == M.getUnitsId ();
+    };
+
+    //! \brief subject of the message
+    const std::string &topic (void) const {
+        return _topic;
+    };
+
+    //! \brief new message with the time and the value of M, buffer is used for encoding
+    zmsg_t *encode (const MetricInfo &M, uint64_t time, std::string &buffer) const;
+
+private:
+    std::string _topic;
+    //! \brief message up to the value, with time set to 0
+    std::string _prefix;
+    //! \brief message after the value
+    std::string _suffix;
+    size_t   _timeOffset = 0;
+    uint64_t _ttl;
+    Symbol   _units;
+    bool     _valid = false;
+};
+
+/*
+ * \brief Writes the shortest representation of value, which is read back the same
+ *
+ * \return length of the string in buffer (at least 32B)
+ */
+size_t formatValue (double value, char *buffer, size_t size);
+
+void
+metricframe_test (bool verbose);
+
+#endif // SRC_METRICFRAME_H_
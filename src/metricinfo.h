@@ -29,18 +29,29 @@
 #include <string>
 #include <ctime>
 
+#include "symboltable.h"
 
+/*
+ * \brief One measurement
+ *
+ * Names are stored as ids of the global SymbolTable, so the copy of
+ * the metric doesn't allocate anything.
+ */
 class MetricInfo {
 
 public:
     std::string generateTopic(void) const {
-        return _source + "@" + _element_name;
+        return getSource() + "@" + getElementName();
     };
 
     MetricInfo()
     :
+        _element_name{SymbolTable::EMPTY},
+        _source{SymbolTable::EMPTY},
+        _units{SymbolTable::EMPTY},
         _value{0},
         _timestamp{0},
+        _element_destination_name{SymbolTable::EMPTY},
         _ttl{5 * 60}
     {};
 
@@ -53,12 +64,29 @@ public:
         const std::string &destination,
         uint64_t ttl
         ):
+        _element_name (symbol (element_name)),
+        _source (symbol (source)),
+        _units (symbol (units)),
+        _value (value),
+        _timestamp (timestamp),
+        _element_destination_name (symbol (destination)),
+        _ttl (ttl)
+    {};
+
+    MetricInfo (
+        Symbol element_name,
+        Symbol source,
+        Symbol units,
+        double value,
+        uint64_t timestamp,
+        uint64_t ttl
+        ):
         _element_name (element_name),
         _source (source),
         _units (units),
         _value (value),
         _timestamp (timestamp),
-        _element_destination_name (destination),
+        _element_destination_name (SymbolTable::EMPTY),
         _ttl (ttl)
     {};
 
@@ -66,7 +94,11 @@ public:
         return _value;
     };
 
-    std::string getElementName (void) const{
+    const std::string &getElementName (void) const{
+        return symbolName (_element_name);
+    };
+
+    Symbol getElementId (void) const{
         return _element_name;
     };
 
@@ -75,9 +107,9 @@ public:
     };
 
     bool isUnknown(void) const {
-        if ( _element_name.empty() ||
-             _source.empty() ||
-             _units.empty() ) {
+        if ( _element_name == SymbolTable::EMPTY ||
+             _source == SymbolTable::EMPTY ||
+             _units == SymbolTable::EMPTY ) {
             return true;
         }
         return false;
@@ -87,15 +119,23 @@ public:
         return _ttl;
     };
 
-    std::string getUnits(void) const {
+    const std::string &getUnits(void) const {
+        return symbolName (_units);
+    };
+
+    Symbol getUnitsId (void) const {
         return _units;
     };
 
-    std::string getSource (void) const {
+    const std::string &getSource (void) const {
+        return symbolName (_source);
+    };
+
+    Symbol getSourceId (void) const {
         return _source;
     };
     void setTime(void) { _timestamp = std::time(NULL); };
-    void setUnits(const std::string &U) { _units = U; };
+    void setUnits(const std::string &U) { _units = symbol (U); };
     friend inline bool operator==( const MetricInfo &lhs, const MetricInfo &rhs );
     friend inline bool operator!=( const MetricInfo &lhs, const MetricInfo &rhs );
 
@@ -104,12 +144,12 @@ public:
     friend class MetricList;
 
 private:
-    std::string _element_name;
-    std::string _source;
-    std::string _units;
+    Symbol      _element_name;
+    Symbol      _source;
+    Symbol      _units;
     double      _value;
     uint64_t    _timestamp;
-    std::string _element_destination_name;
+    Symbol      _element_destination_name;
 
     // time to live [s]
     uint64_t _ttl;
@@ -24,79 +24,157 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include <cassert>
 
+bool MetricList::
+    topicKey (const std::string &topic, TopicKey &key)
+{
+    size_t at = topic.find ('@');
+    if ( at == std::string::npos ) {
+        return false;
+    }
+    const SymbolTable &symbols = SymbolTable::instance();
+    Symbol quantity = symbols.find (topic.data(), at);
+    Symbol element = symbols.find (topic.data() + at + 1, topic.size() - at - 1);
+    if ( quantity == SymbolTable::NOT_FOUND || element == SymbolTable::NOT_FOUND ) {
+        // name was never seen, so there is no such metric
+        return false;
+    }
+    key = topicKey (quantity, element);
+    return true;
+}
+
+
 void MetricList::
     addMetric (const MetricInfo &metricInfo)
 {
+    uint64_t expiration = metricInfo._timestamp + metricInfo._ttl;
+    TopicKey topic = topicKey (metricInfo._source, metricInfo._element_name);
     // try to find topic
-    auto it = _knownMetrics.find (metricInfo.generateTopic());
-    if ( it != _knownMetrics.cend() ) {
+    auto it = _knownMetrics.find (topic);
+    if ( it != _knownMetrics.end() ) {
         // if it was found -> replace with new value
-        it->second = metricInfo;
+        it->second.metric = metricInfo;
+        if ( expiration < it->second.scheduled ) {
+            // metric expires sooner than it is planned
+            it->second.scheduled = expiration;
+            _expirations.emplace (expiration, topic);
+        }
     }
     else {
         // if it wasn't found -> insert new metric
-        _knownMetrics.emplace (metricInfo.generateTopic(), metricInfo);
+        _knownMetrics.emplace (topic, KnownMetric { metricInfo, expiration });
+        _expirations.emplace (expiration, topic);
     }
     _lastInsertedMetric = metricInfo;
 }
 
 
 double MetricList::
-    findAndCheck (const std::string &topic) const
+    findAndCheck (Symbol quantity, Symbol element) const
 {
-    auto it = _knownMetrics.find(topic);
+    auto it = _knownMetrics.find (topicKey (quantity, element));
     if ( it == _knownMetrics.cend() ) {
         return NAN;
     }
     else {
         uint64_t currentTimestamp = ::time(NULL);
-        if ( ( currentTimestamp - it->second._timestamp ) > it->second._ttl ) {
+        const MetricInfo &metric = it->second.metric;
+        if ( ( currentTimestamp - metric._timestamp ) > metric._ttl ) {
             return NAN;
         }
         else {
-            return it->second._value;
+            return metric._value;
         }
     }
 }
 
 
 double MetricList::
-    find (const std::string &topic) const
+    findAndCheck (const std::string &topic) const
 {
-    auto it = _knownMetrics.find(topic);
+    TopicKey key;
+    if ( !topicKey (topic, key) ) {
+        return NAN;
+    }
+    return findAndCheck (key >> 32, key & UINT32_MAX);
+}
+
+
+double MetricList::
+    find (Symbol quantity, Symbol element) const
+{
+    auto it = _knownMetrics.find (topicKey (quantity, element));
     if ( it == _knownMetrics.cend() ) {
         return NAN;
     }
     else {
-        return it->second._value;
+        return it->second.metric._value;
     }
 }
 
 
+double MetricList::
+    find (const std::string &topic) const
+{
+    TopicKey key;
+    if ( !topicKey (topic, key) ) {
+        return NAN;
+    }
+    return find (key >> 32, key & UINT32_MAX);
+}
+
+
 MetricInfo MetricList::
-    getMetricInfo (const std::string &topic) const
+    getMetricInfo (Symbol quantity, Symbol element) const
 {
-    auto it = _knownMetrics.find(topic);
+    auto it = _knownMetrics.find (topicKey (quantity, element));
     if ( it == _knownMetrics.cend() ) {
         return MetricInfo();
     }
     else {
-        return it->second;
+        return it->second.metric;
+    }
+}
+
+
+MetricInfo MetricList::
+    getMetricInfo (const std::string &topic) const
+{
+    TopicKey key;
+    if ( !topicKey (topic, key) ) {
+        return MetricInfo();
     }
+    return getMetricInfo (key >> 32, key & UINT32_MAX);
 }
 
 
-void MetricList::removeOldMetrics()
+void MetricList::
+    removeOldMetrics (const std::function<void(const MetricInfo&)> &onExpired)
 {
     uint64_t currentTimestamp = ::time(NULL);
 
-    for ( std::map<std::string, MetricInfo>::iterator iter = _knownMetrics.begin(); iter != _knownMetrics.end() ; /* empty */)
+    while ( !_expirations.empty() && _expirations.top().first < currentTimestamp )
     {
-        if ( ( currentTimestamp - iter->second._timestamp ) > iter->second.getTtl() ) {
-            _knownMetrics.erase(iter++);
+        Expiration expiration = _expirations.top();
+        _expirations.pop();
+
+        auto it = _knownMetrics.find (expiration.second);
+        if ( it == _knownMetrics.end() || it->second.scheduled != expiration.first ) {
+            // metric was removed or planned again meanwhile
+            continue;
+        }
+        const MetricInfo &metric = it->second.metric;
+        uint64_t metricExpiration = metric._timestamp + metric._ttl;
+        if ( metricExpiration < currentTimestamp ) {
+            MetricInfo expired = metric;
+            _knownMetrics.erase (it);
+            if ( onExpired ) {
+                onExpired (expired);
+            }
         }
         else {
-            ++iter;
+            // metric was refreshed, plan it again
+            it->second.scheduled = metricExpiration;
+            _expirations.emplace (metricExpiration, expiration.second);
         }
     }
 }
@@ -105,5 +183,27 @@ void
 metriclist_test (bool verbose)
 {
     printf (" * metriclist: ");
+    uint64_t now = ::time(NULL);
+    MetricList list;
+    list.addMetric (MetricInfo ("ups", "realpower.default", "W", 1, now, "", 300));
+    list.addMetric (MetricInfo ("ups", "realpower.output.L1", "W", 2, now - 100, "", 10));
+    list.addMetric (MetricInfo ("ups", "realpower.output.L2", "W", 3, now - 100, "", 10));
+    // refreshed metric must not expire
+    list.addMetric (MetricInfo ("ups", "realpower.output.L2", "W", 4, now, "", 10));
+
+    int expired = 0;
+    list.removeOldMetrics ([&expired](const MetricInfo &M) {
+        assert (M.getSource () == "realpower.output.L1");
+        ++expired;
+    });
+    assert (expired == 1);
+    assert (std::isnan (list.find ("realpower.output.L1@ups")));
+    assert (list.find ("realpower.output.L2@ups") == 4);
+    assert (list.find ("realpower.default@ups") == 1);
+
+    // shorter ttl plans the metric again
+    list.addMetric (MetricInfo ("ups", "realpower.default", "W", 5, now - 100, "", 10));
+    list.removeOldMetrics ();
+    assert (std::isnan (list.find ("realpower.default@ups")));
     printf ("OK\n");
 }
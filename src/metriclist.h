@@ -24,7 +24,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define SRC_METRICLIST_H
 
 #include <string>
-#include <map>
+#include <unordered_map>
+#include <queue>
+#include <vector>
+#include <functional>
 
 #include "metricinfo.h"
 
@@ -73,6 +76,7 @@ public:
      *         value - otherwise
      */
     double findAndCheck (const std::string &topic) const;
+    double findAndCheck (Symbol quantity, Symbol element) const;
 
     /*
      * \brief Finds a value of the metric in the list
@@ -85,6 +89,7 @@ public:
      *         value - otherwise
      */
     double find (const std::string &topic) const;
+    double find (Symbol quantity, Symbol element) const;
 
     /*
      * \brief Gets metric by the topic
@@ -97,11 +102,20 @@ public:
      */
     MetricInfo getMetricInfo (
         const std::string &topic) const;
+    MetricInfo getMetricInfo (
+        Symbol quantity,
+        Symbol element) const;
 
     /*
      * \brief Removes old metrics from the list
+     *
+     * Only metrics, which expiration time ( timestamp + ttl ) is in
+     * the past are visited, the rest of the list is not touched.
+     *
+     * \param[in] onExpired - optional function called for every removed metric
      */
-    void removeOldMetrics (void);
+    void removeOldMetrics (
+        const std::function<void(const MetricInfo&)> &onExpired = nullptr);
 
     /*
      * \brief Gets the last added metric
@@ -114,8 +128,30 @@ public:
 
 private:
 
+    struct KnownMetric {
+        MetricInfo metric;
+        // expiration time, under which the metric is planned in _expirations
+        uint64_t scheduled;
+    };
+
+    // topic quantity@element as one number
+    typedef uint64_t TopicKey;
+    static TopicKey topicKey (Symbol quantity, Symbol element) {
+        return ( static_cast<TopicKey> (quantity) << 32 ) | element;
+    };
+    // converts string topic, returns false if topic can't be known
+    static bool topicKey (const std::string &topic, TopicKey &key);
+
     // Metric list <topic, Metric>
-    std::map <std::string, MetricInfo> _knownMetrics;
+    std::unordered_map <TopicKey, KnownMetric> _knownMetrics;
+
+    // planned expiration <time, topic>
+    typedef std::pair <uint64_t, TopicKey> Expiration;
+
+    // min-heap of expirations. There is at most one valid entry per topic
+    // (time == KnownMetric::scheduled), others are skipped when popped.
+    // Metric can be refreshed meanwhile, so it is planned again then.
+    std::priority_queue <Expiration, std::vector<Expiration>, std::greater<Expiration> > _expirations;
 
     // Keep track of last inserted metric
     MetricInfo _lastInsertedMetric;
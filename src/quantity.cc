@@ -0,0 +1,64 @@
+/*  =========================================================================
+    quantity - Registry of computed quantities
+
+    Copyright (C) 2014 - 2018 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    quantity - Registry of computed quantities
+@discuss
+@end
+*/
+
+#include "fty_metric_tpower_classes.h"
+
+TPowerQuantity
+tpowerQuantity (const char *data, size_t size)
+{
+    TPowerQuantity quantity = TPOWER_QUANTITY_TABLE[tpowerQuantityBucket (data, size)];
+    if (quantity == TPOWER_QUANTITY_UNKNOWN)
+        return quantity;
+    // some other name can have the same hash
+    const TPowerQuantityInfo &info = TPOWER_QUANTITIES[quantity];
+    if (info.length != size || memcmp (info.name, data, size) != 0)
+        return TPOWER_QUANTITY_UNKNOWN;
+    return quantity;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+quantity_test (bool verbose)
+{
+    printf (" * quantity: ");
+    for (int i = 0; i < TPOWER_QUANTITY_COUNT; ++i) {
+        TPowerQuantity quantity = static_cast<TPowerQuantity> (i);
+        const char *name = tpowerQuantityName (quantity);
+        assert (tpowerQuantity (name, strlen (name)) == quantity);
+        // symbols of quantities are reserved
+        assert (tpowerQuantitySymbol (quantity) == SymbolTable::instance ().find (name));
+    }
+    const char *topic = "realpower.output.L2@epdu-1";
+    assert (tpowerQuantity (topic, strchr (topic, '@') - topic) == TPOWER_REALPOWER_OUTPUT_L2);
+    assert (tpowerQuantity (topic, strlen (topic)) == TPOWER_QUANTITY_UNKNOWN);
+    assert (tpowerQuantity ("realpower.output.L4", 19) == TPOWER_QUANTITY_UNKNOWN);
+    assert (tpowerQuantity ("", 0) == TPOWER_QUANTITY_UNKNOWN);
+    printf ("OK\n");
+}
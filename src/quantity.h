@@ -0,0 +1,144 @@
+/*  =========================================================================
+    quantity - Registry of computed quantities
+
+    Copyright (C) 2014 - 2018 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*! \file   quantity.h
+ *  \brief  Quantities computed for racks and DCs, known at compile time
+ */
+
+#ifndef SRC_QUANTITY_H_
+#define SRC_QUANTITY_H_
+
+#include <cstddef>
+#include <cstdint>
+
+//! \brief quantities we are interested in, the value is index to TPOWER_QUANTITIES
+enum TPowerQuantity {
+    TPOWER_REALPOWER_DEFAULT = 0,
+    TPOWER_REALPOWER_INPUT_L1,
+    TPOWER_REALPOWER_INPUT_L2,
+    TPOWER_REALPOWER_INPUT_L3,
+    TPOWER_REALPOWER_OUTPUT_L1,
+    TPOWER_REALPOWER_OUTPUT_L2,
+    TPOWER_REALPOWER_OUTPUT_L3,
+    TPOWER_QUANTITY_COUNT,
+    TPOWER_QUANTITY_UNKNOWN = TPOWER_QUANTITY_COUNT
+};
+
+//! \brief how the total of the quantity is computed from powerdevices
+enum TPowerMethod {
+    //! sum of the quantity over all devices
+    TPOWER_METHOD_SUM,
+    //! sum of realpower.default, sum of output phases if device doesn't have it
+    TPOWER_METHOD_REALPOWER_DEFAULT,
+    //! output phase, unknown if single and three phase devices are mixed
+    TPOWER_METHOD_REALPOWER_OUTPUT,
+};
+
+struct TPowerQuantityInfo {
+    const char   *name;
+    size_t        length;
+    TPowerMethod  method;
+    //! \brief quantity is computed for racks
+    bool          rack;
+    //! \brief quantity is computed for datacenters
+    bool          dc;
+};
+
+constexpr size_t tpowerStrlen (const char *s) {
+    return *s ? 1 + tpowerStrlen (s + 1) : 0;
+}
+
+#define TPOWER_QUANTITY(name, method, rack, dc) \
+    { name, tpowerStrlen (name), method, rack, dc }
+
+//! \brief registry of quantities, order is the same as in TPowerQuantity
+constexpr TPowerQuantityInfo TPOWER_QUANTITIES[TPOWER_QUANTITY_COUNT] = {
+    TPOWER_QUANTITY ("realpower.default",   TPOWER_METHOD_REALPOWER_DEFAULT, true,  true),
+    TPOWER_QUANTITY ("realpower.input.L1",  TPOWER_METHOD_SUM,               false, true),
+    TPOWER_QUANTITY ("realpower.input.L2",  TPOWER_METHOD_SUM,               false, true),
+    TPOWER_QUANTITY ("realpower.input.L3",  TPOWER_METHOD_SUM,               false, true),
+    TPOWER_QUANTITY ("realpower.output.L1", TPOWER_METHOD_REALPOWER_OUTPUT,  false, true),
+    TPOWER_QUANTITY ("realpower.output.L2", TPOWER_METHOD_REALPOWER_OUTPUT,  false, true),
+    TPOWER_QUANTITY ("realpower.output.L3", TPOWER_METHOD_REALPOWER_OUTPUT,  false, true),
+};
+
+#undef TPOWER_QUANTITY
+
+// --------------------------------------------------------------------------
+// Perfect hash of the names: FNV-1a modulo TPOWER_QUANTITY_BUCKETS is
+// collision free for the registry, this is checked at compile time below.
+// When a quantity is added, the seed or number of buckets may need a change.
+
+constexpr uint32_t TPOWER_QUANTITY_HASH_SEED = 2166136261u;
+constexpr size_t   TPOWER_QUANTITY_BUCKETS = 16;
+
+constexpr uint32_t tpowerQuantityHash (const char *data, size_t size, uint32_t hash = TPOWER_QUANTITY_HASH_SEED) {
+    return size == 0 ? hash :
+        tpowerQuantityHash (data + 1, size - 1, ( hash ^ static_cast<unsigned char> (*data) ) * 16777619u);
+}
+
+constexpr size_t tpowerQuantityBucket (const char *data, size_t size) {
+    return tpowerQuantityHash (data, size) % TPOWER_QUANTITY_BUCKETS;
+}
+
+//! \brief bucket -> quantity
+constexpr TPowerQuantity TPOWER_QUANTITY_TABLE[TPOWER_QUANTITY_BUCKETS] = {
+    TPOWER_QUANTITY_UNKNOWN,    //  0
+    TPOWER_QUANTITY_UNKNOWN,    //  1
+    TPOWER_QUANTITY_UNKNOWN,    //  2
+    TPOWER_QUANTITY_UNKNOWN,    //  3
+    TPOWER_REALPOWER_OUTPUT_L3, //  4
+    TPOWER_REALPOWER_INPUT_L1,  //  5
+    TPOWER_QUANTITY_UNKNOWN,    //  6
+    TPOWER_REALPOWER_OUTPUT_L2, //  7
+    TPOWER_QUANTITY_UNKNOWN,    //  8
+    TPOWER_QUANTITY_UNKNOWN,    //  9
+    TPOWER_REALPOWER_OUTPUT_L1, // 10
+    TPOWER_QUANTITY_UNKNOWN,    // 11
+    TPOWER_REALPOWER_INPUT_L2,  // 12
+    TPOWER_REALPOWER_DEFAULT,   // 13
+    TPOWER_QUANTITY_UNKNOWN,    // 14
+    TPOWER_REALPOWER_INPUT_L3,  // 15
+};
+
+constexpr bool tpowerQuantityTableValid (size_t i = 0) {
+    return i == TPOWER_QUANTITY_COUNT ||
+        ( TPOWER_QUANTITY_TABLE[tpowerQuantityBucket (TPOWER_QUANTITIES[i].name, TPOWER_QUANTITIES[i].length)] == i &&
+          tpowerQuantityTableValid (i + 1) );
+}
+
+static_assert (tpowerQuantityTableValid (), "TPOWER_QUANTITY_TABLE doesn't match TPOWER_QUANTITIES");
+
+/*
+ * \brief Classifies quantity name (for example subject up to '@')
+ *
+ * \return quantity or TPOWER_QUANTITY_UNKNOWN if we are not interested in it
+ */
+TPowerQuantity tpowerQuantity (const char *data, size_t size);
+
+inline const char *tpowerQuantityName (TPowerQuantity quantity) {
+    return TPOWER_QUANTITIES[quantity].name;
+}
+
+void
+quantity_test (bool verbose);
+
+#endif // SRC_QUANTITY_H_
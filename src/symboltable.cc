@@ -0,0 +1,209 @@
+/*  =========================================================================
+    symboltable - Interning of names
+
+    Copyright (C) 2014 - 2018 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    symboltable - Interning of names
+@discuss
+@end
+*/
+
+#include "fty_metric_tpower_classes.h"
+#include <thread>
+
+// FNV-1a
+static size_t
+    s_hash (const char *data, size_t size)
+{
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char> (data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+SymbolTable::Index::
+    Index (size_t capacity) :
+    mask (capacity - 1),
+    slots (new std::atomic<Symbol>[capacity])
+{
+    for (size_t i = 0; i < capacity; ++i) {
+        slots[i].store (0, std::memory_order_relaxed);
+    }
+}
+
+SymbolTable::
+    SymbolTable ()
+{
+    for (auto &chunk : _chunks) {
+        chunk.store (NULL, std::memory_order_relaxed);
+    }
+    _size.store (0, std::memory_order_relaxed);
+    _indexes.emplace_back (new Index (2 * FIRST_CHUNK));
+    _index.store (_indexes.back ().get (), std::memory_order_release);
+    // empty string has always id 0
+    intern ("", 0);
+    // then quantities, see tpowerQuantitySymbol
+    for (int i = 0; i < TPOWER_QUANTITY_COUNT; ++i) {
+        intern (TPOWER_QUANTITIES[i].name, TPOWER_QUANTITIES[i].length);
+    }
+}
+
+SymbolTable::
+    ~SymbolTable ()
+{
+    for (auto &chunk : _chunks) {
+        delete [] chunk.load (std::memory_order_relaxed);
+    }
+}
+
+SymbolTable &SymbolTable::
+    instance (void)
+{
+    static SymbolTable table;
+    return table;
+}
+
+Symbol SymbolTable::
+    lookup (const Index &index, const char *data, size_t size, size_t hash) const
+{
+    for (size_t i = hash & index.mask; ; i = (i + 1) & index.mask) {
+        Symbol slot = index.slots[i].load (std::memory_order_acquire);
+        if (slot == 0) {
+            return NOT_FOUND;
+        }
+        const std::string &stored = name (slot - 1);
+        if (stored.size () == size && memcmp (stored.data (), data, size) == 0) {
+            return slot - 1;
+        }
+    }
+}
+
+void SymbolTable::
+    add (Index &index, Symbol id, size_t hash)
+{
+    size_t i = hash & index.mask;
+    while (index.slots[i].load (std::memory_order_relaxed) != 0) {
+        i = (i + 1) & index.mask;
+    }
+    // name is stored already
+    index.slots[i].store (id + 1, std::memory_order_release);
+}
+
+Symbol SymbolTable::
+    intern (const char *data, size_t size)
+{
+    Symbol id = find (data, size);
+    if (id != NOT_FOUND) {
+        return id;
+    }
+    std::lock_guard <std::mutex> lock (_mutex);
+    // it can be added meanwhile
+    size_t hash = s_hash (data, size);
+    Index *index = _indexes.back ().get ();
+    id = lookup (*index, data, size, hash);
+    if (id != NOT_FOUND) {
+        return id;
+    }
+    id = static_cast<Symbol> (_size.load (std::memory_order_relaxed));
+    size_t chunk, offset;
+    locate (id, chunk, offset);
+    std::string *names = _chunks[chunk].load (std::memory_order_relaxed);
+    if (!names) {
+        names = new std::string[FIRST_CHUNK << chunk];
+        _chunks[chunk].store (names, std::memory_order_release);
+    }
+    names[offset].assign (data, size);
+    // index is at most half full, the grown one is published with the new name
+    size_t capacity = index->mask + 1;
+    if (2 * (size_t (id) + 1) > capacity) {
+        std::unique_ptr<Index> grown (new Index (2 * capacity));
+        for (Symbol i = 0; i < id; ++i) {
+            const std::string &stored = name (i);
+            add (*grown, i, s_hash (stored.data (), stored.size ()));
+        }
+        index = grown.get ();
+        _indexes.push_back (std::move (grown));
+    }
+    add (*index, id, hash);
+    _size.store (size_t (id) + 1, std::memory_order_release);
+    _index.store (index, std::memory_order_release);
+    return id;
+}
+
+Symbol SymbolTable::
+    find (const char *data, size_t size) const
+{
+    const Index *index = _index.load (std::memory_order_acquire);
+    return lookup (*index, data, size, s_hash (data, size));
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+symboltable_test (bool verbose)
+{
+    printf (" * symboltable: ");
+    SymbolTable &table = SymbolTable::instance ();
+    assert (table.intern ("") == SymbolTable::EMPTY);
+    assert (table.intern (NULL) == SymbolTable::EMPTY);
+
+    Symbol ups = table.intern ("ups-symboltable-test");
+    assert (ups != SymbolTable::EMPTY);
+    assert (table.intern (std::string ("ups-symboltable-test")) == ups);
+    assert (table.name (ups) == "ups-symboltable-test");
+
+    // lookup by part of the topic
+    const char *topic = "realpower.default@ups-symboltable-test";
+    assert (table.find (strchr (topic, '@') + 1, strlen ("ups-symboltable-test")) == ups);
+    assert (table.find ("epdu-symboltable-test") == SymbolTable::NOT_FOUND);
+
+    // names are found by readers while other threads add them, the index grows
+    // and names spill over more chunks
+    {
+        size_t before = table.size ();
+        const int COUNT = 5000;
+        std::vector<std::thread> threads;
+        std::atomic<bool> failed (false);
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back ([&table, &failed, t] () {
+                for (int i = 0; i < COUNT; ++i) {
+                    // every name is interned by two threads
+                    std::string name = "rack-symboltable-" + std::to_string ((i * 2 + t) / 2 % COUNT);
+                    Symbol id = table.intern (name);
+                    if (table.find (name) != id || table.name (id) != name ||
+                        table.find ("ups-symboltable-test") == SymbolTable::NOT_FOUND) {
+                        failed = true;
+                    }
+                }
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join ();
+        }
+        assert (!failed);
+        assert (table.size () == before + COUNT);
+        assert (table.name (table.find ("rack-symboltable-4999")) == "rack-symboltable-4999");
+    }
+    printf ("OK\n");
+}
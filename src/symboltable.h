@@ -0,0 +1,174 @@
+/*  =========================================================================
+    symboltable - Interning of names
+
+    Copyright (C) 2014 - 2018 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*! \file   symboltable.h
+ *  \brief  Maps element and quantity names onto dense integer ids
+ */
+
+#ifndef SRC_SYMBOLTABLE_H_
+#define SRC_SYMBOLTABLE_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstring>
+#include <cstdint>
+#include <mutex>
+
+#include "quantity.h"
+
+//! \brief id of interned name, 0 is always the empty string
+typedef uint32_t Symbol;
+
+/*
+ * \brief Table of interned names
+ *
+ * Every name gets its id when it is interned for the first time and keeps
+ * it for the whole life of the process. Names of TPOWER_QUANTITIES are
+ * interned first, so their ids are known in advance. Names are never removed, there
+ * is a limited number of assets and quantities.
+ *
+ * Lookups by (data, size) doesn't allocate any memory.
+ *
+ * The table is shared by the agent actor and shard workers. Lookups don't
+ * lock: names are stored in chunks, which are never moved, and ids are found
+ * in an open addressing index, which is only added to. Only a new name takes
+ * the lock, it is published by atomic stores. Grown index replaces the old
+ * one, which is kept for readers still using it.
+ */
+class SymbolTable {
+public:
+
+    /*
+     * \brief Returns the global table
+     */
+    static SymbolTable &instance (void);
+
+    /*
+     * \brief Returns id of the name, name is added to the table if needed
+     */
+    Symbol intern (const char *data, size_t size);
+    Symbol intern (const std::string &name) {
+        return intern (name.data (), name.size ());
+    };
+    Symbol intern (const char *name) {
+        return name ? intern (name, strlen (name)) : EMPTY;
+    };
+
+    /*
+     * \brief Finds id of the name
+     *
+     * \return id of the name or NOT_FOUND if name was never interned
+     */
+    Symbol find (const char *data, size_t size) const;
+    Symbol find (const std::string &name) const {
+        return find (name.data (), name.size ());
+    };
+
+    /*
+     * \brief Returns name for id
+     */
+    const std::string &name (Symbol id) const {
+        size_t chunk, offset;
+        locate (id, chunk, offset);
+        return _chunks[chunk].load (std::memory_order_acquire)[offset];
+    };
+
+    /*
+     * \brief Number of interned names
+     */
+    size_t size (void) const {
+        return _size.load (std::memory_order_acquire);
+    };
+
+    static const Symbol EMPTY = 0;
+    static const Symbol NOT_FOUND = UINT32_MAX;
+
+private:
+    SymbolTable ();
+    ~SymbolTable ();
+    SymbolTable (const SymbolTable &) = delete;
+    SymbolTable &operator= (const SymbolTable &) = delete;
+
+    // chunk k has FIRST_CHUNK << k names, all ids fit into MAX_CHUNKS chunks
+    static const size_t FIRST_CHUNK_BITS = 10;
+    static const size_t FIRST_CHUNK = size_t (1) << FIRST_CHUNK_BITS;
+    static const size_t MAX_CHUNKS = 33 - FIRST_CHUNK_BITS;
+
+    // chunk and offset in it of the name with id
+    static void locate (Symbol id, size_t &chunk, size_t &offset) {
+        uint64_t position = uint64_t (id) + FIRST_CHUNK;
+        size_t bit = 63 - __builtin_clzll (position);
+        chunk = bit - FIRST_CHUNK_BITS;
+        offset = position - (uint64_t (1) << bit);
+    };
+
+    // open addressing, slot is id + 1, 0 is a free slot
+    struct Index {
+        explicit Index (size_t capacity);
+        size_t mask;
+        std::unique_ptr< std::atomic<Symbol>[] > slots;
+    };
+
+    // id of the name in the index or NOT_FOUND
+    Symbol lookup (const Index &index, const char *data, size_t size, size_t hash) const;
+    // add id to the index, called with the lock
+    static void add (Index &index, Symbol id, size_t hash);
+
+    // id -> name
+    std::atomic<std::string *> _chunks[MAX_CHUNKS];
+    std::atomic<size_t> _size;
+    // name -> id, readers take the current one
+    std::atomic<const Index *> _index;
+    // all indexes, replaced ones can be still read
+    std::vector< std::unique_ptr<Index> > _indexes;
+    // new names
+    std::mutex _mutex;
+};
+
+/*
+ * \brief Shortcuts for the global table
+ */
+inline Symbol symbol (const std::string &name) {
+    return SymbolTable::instance ().intern (name);
+}
+
+inline const std::string &symbolName (Symbol id) {
+    return SymbolTable::instance ().name (id);
+}
+
+/*
+ * \brief Conversion between quantity and its reserved symbol
+ */
+inline Symbol tpowerQuantitySymbol (TPowerQuantity quantity) {
+    return static_cast<Symbol> (quantity) + 1;
+}
+
+inline TPowerQuantity tpowerQuantityOfSymbol (Symbol id) {
+    return ( id >= 1 && id <= TPOWER_QUANTITY_COUNT ) ?
+        static_cast<TPowerQuantity> (id - 1) : TPOWER_QUANTITY_UNKNOWN;
+}
+
+void
+symboltable_test (bool verbose);
+
+#endif // SRC_SYMBOLTABLE_H_
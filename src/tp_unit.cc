@@ -20,209 +20,241 @@
 
 #include "fty_metric_tpower_classes.h"
 #include <ctime>
-#include <exception>
+#include <cmath>
 
-enum TPowerMethod {
-    TPOWER_REALPOWER_DEFAULT = 1,
-    TPOWER_REALPOWER_OUTPUT_L1 = 2,
-    TPOWER_REALPOWER_OUTPUT_L2 = 3,
-    TPOWER_REALPOWER_OUTPUT_L3 = 4,
-};
-
-const std::map<std::string,int> TPUnit::_calculations = {
-    { "realpower.default", TPOWER_REALPOWER_DEFAULT },
-    { "realpower.output.L1", TPOWER_REALPOWER_OUTPUT_L1 },
-    { "realpower.output.L2", TPOWER_REALPOWER_OUTPUT_L2 },
-    { "realpower.output.L3", TPOWER_REALPOWER_OUTPUT_L3 },
-};
+static const Symbol WATT = symbol("W");
 
 double TPUnit::
-    get( const std::string &quantity) const
+    get( TPowerQuantity quantity) const
 {
-    double result = _lastValue.find( quantity );
-    if ( std::isnan(result) ) {
-        throw std::runtime_error("Unknown quantity");
-    }
-    return result;
+    return _lastValue.find( tpowerQuantitySymbol (quantity), _name );
 }
 
 
 MetricInfo TPUnit::
-    getMetricInfo(const std::string &quantity) const
+    getMetricInfo(TPowerQuantity quantity) const
 {
-    auto result = _lastValue.getMetricInfo( generateTopic(quantity) );
-    if ( result.isUnknown() ) {
-        throw std::runtime_error("Unknown quantity");
-    }
-    return result;
+    return _lastValue.getMetricInfo( tpowerQuantitySymbol (quantity), _name );
 }
 
 void TPUnit::
-    set(const std::string &quantity, MetricInfo &measurement)
+    set(TPowerQuantity quantity, const MetricInfo &measurement)
 {
-    double itSums = _lastValue.find(generateTopic(quantity));
-    if( std::isnan(itSums) || ( abs(itSums - measurement.getValue()) > 0.00001) ) {
+    double itSums = _lastValue.find( tpowerQuantitySymbol (quantity), _name );
+    // small changes are filtered by deadband in advertise()
+    if( std::isnan(itSums) || itSums != measurement.getValue() ) {
         _lastValue.addMetric(measurement);
         _changed[quantity] = true;
         _changetimestamp[quantity] = measurement.getTimestamp();
     }
 }
 
-MetricInfo TPUnit::
-    simpleSummarize(const std::string &quantity) const
+void TPUnit::
+    totals(uint32_t quantities, QuantityValues &values) const
 {
-    double sum = 0;
-    for( const auto &it : _powerdevices ) {
-        double value = getMetricValue( it.second, quantity, it.first );
-        if( std::isnan(value) ) {
-            throw std::runtime_error("value can't be calculated");
-        } else {
-            sum += value;
+    values.fill( NAN );
+    bool compatible = phasesCompatible();
+    for( int i = 0; i < TPOWER_QUANTITY_COUNT; ++i ) {
+        if( ! ( quantities & ( 1u << i ) ) ) {
+            continue;
+        }
+        switch( TPOWER_QUANTITIES[i].method ) {
+        case TPOWER_METHOD_REALPOWER_DEFAULT:
+            // running total of realpower.default already falls back to phases
+        case TPOWER_METHOD_SUM:
+            if( ! _totals[i].unknown ) {
+                values[i] = _totals[i].sum;
+            }
+            break;
+        case TPOWER_METHOD_REALPOWER_OUTPUT:
+            // a mix of single and three phase devices is NAN
+            if( compatible ) {
+                values[i] = _values[i][_lastDevice];
+            }
+            break;
         }
     }
-    MetricInfo result ( _name, quantity, "W", sum, ::time (NULL), "", TTL);
-    return result;
 }
 
-MetricInfo TPUnit::
-    realpowerDefault(const std::string &quantity) const
+bool TPUnit::
+    phasesCompatible() const
 {
-    double sum = 0;
-    for( const auto it : _powerdevices ) {
-        double value = getMetricValue( it.second, quantity, it.first );
-        if( std::isnan (value) ) {
-            // realpower.default not present, try to sum the phases
-            for( int phase = 1 ; phase <= 3 ; ++phase ) {
-                double phaseValue = getMetricValue( it.second, "realpower.output.L" + std::to_string( phase ), it.first );
-                if( std::isnan (phaseValue) ) {
-                    throw std::runtime_error("value can't be calculated");
-                }
-                sum += phaseValue;
-            }
-        } else {
-            sum += value;
-        }
+    return ! _devices.empty() &&
+        ( _threePhaseDevices == 0 || _threePhaseDevices == _devices.size() );
+}
+
+double TPUnit::
+    defaultContribution(size_t slot) const
+{
+    double value = _values[TPOWER_REALPOWER_DEFAULT][slot];
+    if( std::isnan (value) ) {
+        // realpower.default not present, try to sum the phases
+        value = _values[TPOWER_REALPOWER_OUTPUT_L1][slot] +
+            _values[TPOWER_REALPOWER_OUTPUT_L2][slot] +
+            _values[TPOWER_REALPOWER_OUTPUT_L3][slot];
     }
-    MetricInfo result ( _name, quantity, "W", sum, ::time (NULL), "", TTL);
-    return result;
+    return value;
 }
 
-MetricInfo TPUnit::
-    realpowerOutput(const std::string &quantity) const
+void TPUnit::
+    updateTotal(TPowerQuantity quantity, double before, double after)
 {
-    double value = NAN;
-    std::string phases {"n/a"};
-    for( const auto it : _powerdevices ) {
-        value = getMetricValue( it.second, quantity, it.first );
-
-        double roL2 = getMetricValue (it.second, "realpower.output.L2", it.first);
-
-        // detect a mix of single and three phase devices - return NAN for this case
-        if (phases == "n/a") {
-            if (std::isnan (roL2))
-                phases = "single";
-            else
-                phases = "three";
-        }
-        else {
-            if ((std::isnan (roL2) && phases == "three") ||
-                (!std::isnan (roL2) && phases == "single")) {
-                return MetricInfo ( _name, quantity, "W", NAN, ::time (NULL), "", TTL);
-            }
-        }
+    auto &T = _totals[quantity];
+    ++_totalUpdates;
+    if( std::isnan (before) ) {
+        if( std::isnan (after) ) return;
+        --T.unknown;
+        T.sum += after;
+    } else if( std::isnan (after) ) {
+        ++T.unknown;
+        T.sum -= before;
+    } else {
+        T.sum += after - before;
     }
+}
 
-    MetricInfo result ( _name, quantity, "W", value, ::time (NULL), "", TTL);
-    return result;
+void TPUnit::
+    recalculateTotals()
+{
+    _totalUpdates = 0;
+    size_t devices = _devices.size();
+    for( size_t slot = 0; slot < devices; ++slot ) {
+        _defaultContributions[slot] = defaultContribution( slot );
+    }
+    // contiguous values of each quantity are summed by SIMD kernel
+    for( int i = 0; i < TPOWER_QUANTITY_COUNT; ++i ) {
+        const auto &values = i == TPOWER_REALPOWER_DEFAULT ? _defaultContributions : _values[i];
+        TPowerReduction reduction = tpowerReduce( values.data(), devices );
+        _totals[i].sum = reduction.sum;
+        _totals[i].unknown = devices - reduction.valid;
+    }
+    _threePhaseDevices = devices - _totals[TPOWER_REALPOWER_OUTPUT_L2].unknown;
 }
 
 void TPUnit::
-    calculate(const std::vector<std::string> &quantities)
+    deviceChanged(
+        size_t slot,
+        TPowerQuantity quantity,
+        double before,
+        double after
+    )
+{
+    if( quantity == TPOWER_REALPOWER_DEFAULT ||
+        TPOWER_QUANTITIES[quantity].method == TPOWER_METHOD_REALPOWER_OUTPUT )
+    {
+        // realpower.default of the device can be also computed from output phases
+        double contribution = defaultContribution( slot );
+        updateTotal( TPOWER_REALPOWER_DEFAULT, _defaultContributions[slot], contribution );
+        _defaultContributions[slot] = contribution;
+    }
+    if( quantity != TPOWER_REALPOWER_DEFAULT ) {
+        updateTotal( quantity, before, after );
+    }
+    if( quantity == TPOWER_REALPOWER_OUTPUT_L2 &&
+        std::isnan (before) != std::isnan (after) )
+    {
+        if( std::isnan (before) ) {
+            ++_threePhaseDevices;
+        } else {
+            --_threePhaseDevices;
+        }
+    }
+}
+
+void TPUnit::
+    calculate(const std::vector<TPowerQuantity> &quantities)
 {
     dropOldMetricInfos();
+    uint32_t mask = 0;
     for( const auto it : quantities ) {
-        calculate( it );
+        mask |= 1u << it;
     }
+    calculate( mask );
 }
 
 void TPUnit::
-    calculate(const std::string &quantity)
+    calculate(uint32_t quantities)
 {
-    try {
-        MetricInfo result;
-        int calc = 0;
-        const auto how = _calculations.find(quantity);
-        if( how != _calculations.cend() ) calc = how->second;
-        switch( calc ) {
-        case TPOWER_REALPOWER_DEFAULT:
-            result = realpowerDefault( quantity );
-            break;
-        case TPOWER_REALPOWER_OUTPUT_L1:
-        case TPOWER_REALPOWER_OUTPUT_L2:
-        case TPOWER_REALPOWER_OUTPUT_L3:
-            result = realpowerOutput (quantity);
-            break;
-        default:
-            result = simpleSummarize( quantity );
-            break;
+    QuantityValues values;
+    totals( quantities, values );
+    uint64_t now = ::time (NULL);
+    for( int i = 0; i < TPOWER_QUANTITY_COUNT; ++i ) {
+        if( ! ( quantities & ( 1u << i ) ) ) {
+            continue;
+        }
+        // unknown sum keeps the last value, unknown output phase is stored as NAN
+        if( ! std::isnan (values[i]) ||
+            TPOWER_QUANTITIES[i].method == TPOWER_METHOD_REALPOWER_OUTPUT )
+        {
+            auto quantity = static_cast<TPowerQuantity> (i);
+            MetricInfo result ( _name, tpowerQuantitySymbol (quantity), WATT, values[i], now, TTL);
+            set( quantity, result );
         }
-        set( quantity, result );
-    } catch (...) { }
+    }
 }
 
-double TPUnit::
-    getMetricValue(
-        const MetricList  &measurements,
-        const std::string &quantity,
-        const std::string &deviceName
-    ) const
+void TPUnit::
+    calculate(TPowerQuantity quantity)
 {
-    std::string topic = quantity + "@" + deviceName;
-    return measurements.find(topic);
+    calculate( static_cast<uint32_t> ( 1u << quantity ) );
 }
+
 // TODO setup max life time metric
 void TPUnit::
     dropOldMetricInfos(void)
 {
-//    uint64_t now = std::time(NULL);
-    for( auto & device : _powerdevices ) {
-        auto &measurements = device.second;
-        measurements.removeOldMetrics();
+    uint64_t now = std::time(NULL);
+    if( _nextExpiration >= now ) {
+        // nothing expired yet
+        _lastValue.removeOldMetrics();
+        return;
+    }
+    _nextExpiration = UINT64_MAX;
+    for( int i = 0; i < TPOWER_QUANTITY_COUNT; ++i ) {
+        auto &values = _values[i];
+        for( size_t slot = 0; slot < values.size(); ++slot ) {
+            if( std::isnan (values[slot]) ) {
+                continue;
+            }
+            uint64_t expiration = _timestamps[i][slot] + _ttls[i][slot];
+            if( expiration < now ) {
+                double before = values[slot];
+                values[slot] = NAN;
+                deviceChanged( slot, static_cast<TPowerQuantity> (i), before, NAN );
+            } else if( expiration < _nextExpiration ) {
+                _nextExpiration = expiration;
+            }
+        }
     }
     _lastValue.removeOldMetrics();
-}
-
-std::string TPUnit::
-    generateTopic (const std::string &quantity) const
-{
-    return quantity + "@" + _name;
+    // sum again from scratch from time to time to drop accumulated rounding errors
+    if( _totalUpdates > TOTALS_RESYNC_FACTOR * _devices.size() ) {
+        recalculateTotals();
+    }
 }
 
 bool TPUnit::
-    quantityIsUnknown(const std::string &topic) const
+    quantityIsUnknown(TPowerQuantity quantity) const
 {
-    return  std::isnan(_lastValue.find(topic));
+    return  std::isnan(_lastValue.find( tpowerQuantitySymbol (quantity), _name ));
 }
 
 std::vector<std::string> TPUnit::
-    devicesInUnknownState(const std::string &quantity) const
+    devicesInUnknownState(TPowerQuantity quantity) const
 {
     std::vector<std::string> result;
 
-    if ( quantityIsKnown( generateTopic(quantity) ) ) {
+    if ( quantityIsKnown( quantity ) ) {
         return result;
     }
 
     uint64_t now = std::time(NULL);
-    for( const auto &device : _powerdevices ) {
-        const auto &deviceMetrics = device.second;
-        std::string topic = quantity + "@" + device.first;
-        auto measurement = deviceMetrics.getMetricInfo(topic);
-        if ( ( std::isnan (measurement.getValue()) ) ||
-             ( now - measurement.getTimestamp() > measurement.getTtl() * 2 )
+    for( size_t slot = 0; slot < _devices.size(); ++slot ) {
+        if ( ( std::isnan (_values[quantity][slot]) ) ||
+             ( now - _timestamps[quantity][slot] > _ttls[quantity][slot] * 2 )
            )
         {
-            result.push_back( device.first );
+            result.push_back( symbolName (_devices[slot]) );
         }
     }
     return result;
@@ -231,101 +263,391 @@ std::vector<std::string> TPUnit::
 void TPUnit::
     addPowerDevice(const std::string &device)
 {
-    _powerdevices[device] = {};
+    Symbol name = symbol (device);
+    if( _deviceSlots.count( name ) ) {
+        // known device keeps its measurements
+        return;
+    }
+    size_t slot = _devices.size();
+    _deviceSlots[name] = slot;
+    _devices.push_back( name );
+    for( int i = 0; i < TPOWER_QUANTITY_COUNT; ++i ) {
+        _values[i].resize( _devices.size(), NAN );
+        _timestamps[i].resize( _devices.size() );
+        _ttls[i].resize( _devices.size() );
+        // new device is unknown in every running total
+        ++_totals[i].unknown;
+    }
+    _defaultContributions.resize( _devices.size(), NAN );
+    // output phases are taken from the lexicographically last device, see totals()
+    if( symbolName( _devices[_lastDevice] ) < device ) {
+        _lastDevice = slot;
+    }
 }
 
 void TPUnit::
     setMeasurement(const MetricInfo &M)
 {
-    auto device = _powerdevices.find( M.getElementName() );
-    if( device != _powerdevices.end() ) {
-        device->second.addMetric (M);
+    TPowerQuantity quantity = tpowerQuantityOfSymbol( M.getSourceId() );
+    if( quantity == TPOWER_QUANTITY_UNKNOWN ) {
+        return;
     }
+    auto device = _deviceSlots.find( M.getElementId() );
+    if( device == _deviceSlots.end() ) {
+        return;
+    }
+    size_t slot = device->second;
+    double previous = _values[quantity][slot];
+    _values[quantity][slot] = M.getValue();
+    _timestamps[quantity][slot] = M.getTimestamp();
+    _ttls[quantity][slot] = M.getTtl();
+    uint64_t expiration = M.getTimestamp() + M.getTtl();
+    if( expiration < _nextExpiration ) {
+        _nextExpiration = expiration;
+    }
+    deviceChanged( device->second, quantity, previous, M.getValue() );
 }
 
 bool TPUnit::
-    changed(const std::string &quantity) const
+    changed(TPowerQuantity quantity) const
 {
-    auto it = _changed.find(quantity);
-    if( it == _changed.end() ) {
-        return false;
-    }
-    return it->second;
+    return _changed[quantity];
 }
 
 void TPUnit::
-    changed(const std::string &quantity, bool newStatus)
+    changed(TPowerQuantity quantity, bool newStatus)
 {
     if( changed( quantity ) != newStatus ) {
         _changed[quantity] = newStatus;
         _changetimestamp[quantity] = ::time(NULL);
-        if( _advertisedtimestamp.find(quantity) == _advertisedtimestamp.end() ) {
-            _advertisedtimestamp[quantity] = 0;
-        }
     }
 }
 
 void TPUnit::
-    advertised(const std::string &quantity)
+    advertised(TPowerQuantity quantity)
 {
     changed( quantity, false );
     int64_t now_timestamp = ::time(NULL);
     _changetimestamp[quantity] = now_timestamp;
     _advertisedtimestamp[quantity] = now_timestamp;
+    _advertisedvalue[quantity] = _lastValue.find( tpowerQuantitySymbol (quantity), _name );
+}
+
+void TPUnit::
+    notAdvertised( TPowerQuantity quantity, double value )
+{
+    if( _advertisedtimestamp[quantity] == 0 || _advertisedvalue[quantity] != value ) {
+        // other value was advertised since then
+        return;
+    }
+    // as if it was never advertised, see advertise()
+    _advertisedtimestamp[quantity] = 0;
+    changed( quantity, true );
 }
 
 uint64_t TPUnit::
-    timestamp( const std::string &quantity ) const
+    timestamp( TPowerQuantity quantity ) const
 {
-    auto it = _changetimestamp.find(quantity);
-    if( it == _changetimestamp.end() ) return 0;
-    return it->second;
+    return _changetimestamp[quantity];
+}
+
+uint64_t TPUnit::
+    advertisementDue( TPowerQuantity quantity ) const
+{
+    auto quantityTimestamp = silenceStart (quantity);
+    if ( ( quantityTimestamp == 0 ) ||
+           quantityIsUnknown(quantity)
+       )
+    {
+        // if quantity didn't change and it is still unknown
+        return ::time(NULL) + _policies[quantity].maxSilence;
+    }
+    // see advertise()
+    return quantityTimestamp + _policies[quantity].maxSilence + 1;
+}
+
+uint64_t TPUnit::
+    scheduled( TPowerQuantity quantity ) const
+{
+    return _scheduledtimestamp[quantity];
+}
+
+void TPUnit::
+    scheduled( TPowerQuantity quantity, uint64_t due )
+{
+    _scheduledtimestamp[quantity] = due;
 }
 
 int64_t TPUnit::
-    timeToAdvertisement ( const std::string &quantity ) const
+    timeToAdvertisement ( TPowerQuantity quantity ) const
 {
-    auto quantityTimestamp = timestamp (quantity);
+    auto quantityTimestamp = silenceStart (quantity);
+    uint64_t maxSilence = _policies[quantity].maxSilence;
     if ( ( quantityTimestamp == 0 ) ||
-           quantityIsUnknown(generateTopic(quantity))
+           quantityIsUnknown(quantity)
        )
     {
         // if quantity didn't change and it is still unknown
-        return TPOWER_MEASUREMENT_REPEAT_AFTER;
+        return maxSilence;
     }
     uint64_t dt = ::time(NULL) - quantityTimestamp;
-    if ( dt > TPOWER_MEASUREMENT_REPEAT_AFTER ) {
+    if ( dt > maxSilence ) {
         // no time left for waiting -> Need to advertise
         return 0;
     }
     // we should wait a little bit, before advertising
-    return TPOWER_MEASUREMENT_REPEAT_AFTER - dt;
+    return maxSilence - dt;
 }
 
 bool TPUnit::
-    advertise( const std::string &quantity ) const
+    advertise( TPowerQuantity quantity ) const
 {
-    if ( quantityIsUnknown(generateTopic(quantity)) ) {
+    if ( quantityIsUnknown(quantity) ) {
         // if do not know the quantity -> nothing to advertise
         return false;
     }
     uint64_t now_timestamp = ::time(NULL);
     // find the time, when quantity was advertised last time
-    const auto it = _advertisedtimestamp.find(quantity);
-    if ( ( it != _advertisedtimestamp.end() ) &&
-         ( it->second == now_timestamp ) )
-    {
+    if ( _advertisedtimestamp[quantity] == now_timestamp ) {
         // if time is known and
         //    time is just now was advertised -> nothing to advertise
         return false;
     }
+    const auto &policy = _policies[quantity];
     // advertise if
-    // * value changed or
-    // * we should advertise according schedule
-    return ( changed(quantity) || ( now_timestamp - timestamp(quantity) > TPOWER_MEASUREMENT_REPEAT_AFTER ) );
+    // * we should advertise according schedule or
+    // * value changed more than the deadband since the last advertisement
+    if ( now_timestamp - silenceStart(quantity) > policy.maxSilence ) {
+        return true;
+    }
+    if ( ! changed(quantity) ) {
+        return false;
+    }
+    if ( _advertisedtimestamp[quantity] == 0 ) {
+        return true;
+    }
+    double last = _advertisedvalue[quantity];
+    double delta = std::fabs( _lastValue.find( tpowerQuantitySymbol (quantity), _name ) - last );
+    return delta > policy.absoluteDeadband && delta > policy.relativeDeadband * std::fabs(last);
 }
 
+uint64_t TPUnit::
+    silenceStart( TPowerQuantity quantity ) const
+{
+    // small changes don't count, they are not advertised
+    return _advertisedtimestamp[quantity] ? _advertisedtimestamp[quantity] : timestamp(quantity);
+}
+
+// Recompute unit of many devices after each measurement, one device is
+// offline optionally, returns ns per measurement
+static double
+    s_benchmark (bool offline)
+{
+    static const int DEVICES = 100;
+    static const int ROUNDS = 100;
+    uint64_t now = ::time (NULL);
+    TPUnit unit;
+    unit.name ("dc-benchmark");
+    for (int i = 0; i < DEVICES; ++i) {
+        unit.addPowerDevice ("ups-benchmark-" + std::to_string (i));
+    }
+    uint32_t all = (1u << TPOWER_QUANTITY_COUNT) - 1;
+    int64_t start = zclock_usecs ();
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (int i = offline ? 1 : 0; i < DEVICES; ++i) {
+            unit.setMeasurement (MetricInfo ("ups-benchmark-" + std::to_string (i), "realpower.default", "W", round + i, now, "", 300));
+            unit.calculate (all);
+        }
+    }
+    int64_t elapsed = zclock_usecs () - start;
+    assert (unit.quantityIsUnknown (TPOWER_REALPOWER_DEFAULT) == offline);
+    return elapsed * 1000.0 / ROUNDS / (DEVICES - (offline ? 1 : 0));
+}
+
+// unit with access to the advertisement time
+class TestUnit : public TPUnit {
+public:
+    uint64_t advertisedAt (TPowerQuantity quantity) const {
+        return _advertisedtimestamp[quantity];
+    };
+    // pretend, that the quantity was advertised some time ago
+    void advertisedBefore (TPowerQuantity quantity, uint64_t seconds) {
+        _advertisedtimestamp[quantity] -= seconds;
+    };
+};
+
 void tp_unit_test(bool verbose)
 {
-    //empty
+    printf (" * tp_unit: ");
+    uint64_t now = ::time(NULL);
+
+    TestUnit unit;
+    unit.name("rack-1");
+    unit.addPowerDevice("epdu-1");
+    unit.addPowerDevice("epdu-2");
+
+    // one device is still unknown
+    unit.setMeasurement (MetricInfo ("epdu-1", "realpower.default", "W", 100, now, "", 300));
+    unit.calculate (TPOWER_REALPOWER_DEFAULT);
+    assert (unit.quantityIsUnknown (TPOWER_REALPOWER_DEFAULT));
+
+    // the other one reports only phases
+    unit.setMeasurement (MetricInfo ("epdu-2", "realpower.output.L1", "W", 10, now, "", 300));
+    unit.setMeasurement (MetricInfo ("epdu-2", "realpower.output.L2", "W", 20, now, "", 300));
+    unit.calculate (TPOWER_REALPOWER_DEFAULT);
+    assert (unit.quantityIsUnknown (TPOWER_REALPOWER_DEFAULT));
+    unit.setMeasurement (MetricInfo ("epdu-2", "realpower.output.L3", "W", 30, now, "", 300));
+    unit.calculate (TPOWER_REALPOWER_DEFAULT);
+    assert (unit.getMetricInfo (TPOWER_REALPOWER_DEFAULT).getValue () == 160);
+
+    // update of the value is applied as a delta
+    unit.setMeasurement (MetricInfo ("epdu-1", "realpower.default", "W", 150, now, "", 300));
+    unit.setMeasurement (MetricInfo ("epdu-2", "realpower.default", "W", 70, now, "", 300));
+    unit.calculate (TPOWER_REALPOWER_DEFAULT);
+    assert (unit.getMetricInfo (TPOWER_REALPOWER_DEFAULT).getValue () == 220);
+    assert (unit.advertise (TPOWER_REALPOWER_DEFAULT));
+    unit.advertised (TPOWER_REALPOWER_DEFAULT);
+    assert (! unit.advertise (TPOWER_REALPOWER_DEFAULT));
+    assert (unit.advertisementDue (TPOWER_REALPOWER_DEFAULT) == unit.advertisedAt (TPOWER_REALPOWER_DEFAULT) + TPOWER_MEASUREMENT_REPEAT_AFTER + 1);
+
+    // changes within deadband are not advertised
+    TPowerPublishPolicy policy;
+    policy.absoluteDeadband = 5;
+    policy.relativeDeadband = 0.1;
+    policy.maxSilence = 600;
+    unit.policy (TPOWER_REALPOWER_DEFAULT, policy);
+    assert (unit.policy (TPOWER_REALPOWER_DEFAULT).maxSilence == 600);
+    assert (unit.advertisementDue (TPOWER_REALPOWER_DEFAULT) == unit.advertisedAt (TPOWER_REALPOWER_DEFAULT) + 600 + 1);
+    unit.advertisedBefore (TPOWER_REALPOWER_DEFAULT, 10);
+    unit.setMeasurement (MetricInfo ("epdu-1", "realpower.default", "W", 160, now, "", 300));
+    unit.calculate (TPOWER_REALPOWER_DEFAULT);
+    assert (unit.getMetricInfo (TPOWER_REALPOWER_DEFAULT).getValue () == 230);
+    assert (unit.changed (TPOWER_REALPOWER_DEFAULT));
+    // 10W is above absolute, but below 10% of 220W
+    assert (! unit.advertise (TPOWER_REALPOWER_DEFAULT));
+    // silence is counted from the advertisement, not from the small change
+    assert (unit.advertisementDue (TPOWER_REALPOWER_DEFAULT) == unit.advertisedAt (TPOWER_REALPOWER_DEFAULT) + 600 + 1);
+    unit.setMeasurement (MetricInfo ("epdu-1", "realpower.default", "W", 180, now, "", 300));
+    unit.calculate (TPOWER_REALPOWER_DEFAULT);
+    // 30W is out of both deadbands
+    assert (unit.advertise (TPOWER_REALPOWER_DEFAULT));
+    unit.advertised (TPOWER_REALPOWER_DEFAULT);
+    // max silence elapsed, unchanged value is advertised again
+    unit.advertisedBefore (TPOWER_REALPOWER_DEFAULT, 601);
+    assert (! unit.changed (TPOWER_REALPOWER_DEFAULT));
+    assert (unit.advertise (TPOWER_REALPOWER_DEFAULT));
+    unit.advertised (TPOWER_REALPOWER_DEFAULT);
+    // failed advertisement is repeated, unless other value was advertised since
+    double value = unit.get (TPOWER_REALPOWER_DEFAULT);
+    unit.notAdvertised (TPOWER_REALPOWER_DEFAULT, value + 1);
+    assert (! unit.advertise (TPOWER_REALPOWER_DEFAULT));
+    unit.notAdvertised (TPOWER_REALPOWER_DEFAULT, value);
+    assert (unit.changed (TPOWER_REALPOWER_DEFAULT));
+    assert (unit.advertise (TPOWER_REALPOWER_DEFAULT));
+    unit.advertised (TPOWER_REALPOWER_DEFAULT);
+    unit.policy (TPOWER_REALPOWER_DEFAULT, TPowerPublishPolicy ());
+
+    // single and three phase devices are mixed
+    unit.calculate (TPOWER_REALPOWER_OUTPUT_L1);
+    assert (unit.quantityIsUnknown (TPOWER_REALPOWER_OUTPUT_L1));
+
+    // simple sum
+    unit.setMeasurement (MetricInfo ("epdu-1", "realpower.input.L1", "W", 1, now, "", 300));
+    unit.setMeasurement (MetricInfo ("epdu-2", "realpower.input.L1", "W", 2, now, "", 300));
+    unit.calculate (TPOWER_REALPOWER_INPUT_L1);
+    assert (unit.getMetricInfo (TPOWER_REALPOWER_INPUT_L1).getValue () == 3);
+
+    // expired measurements make the total unknown again
+    unit.setMeasurement (MetricInfo ("epdu-1", "realpower.input.L2", "W", 1, now, "", 300));
+    unit.setMeasurement (MetricInfo ("epdu-2", "realpower.input.L2", "W", 2, now - 100, "", 10));
+    unit.dropOldMetricInfos ();
+    unit.calculate (TPOWER_REALPOWER_INPUT_L2);
+    assert (unit.quantityIsUnknown (TPOWER_REALPOWER_INPUT_L2));
+
+    // all quantities in one pass
+    {
+        TPUnit dc;
+        dc.name ("dc-1");
+        dc.addPowerDevice ("ups-1");
+        dc.addPowerDevice ("ups-2");
+        for (const char *device : { "ups-1", "ups-2" }) {
+            dc.setMeasurement (MetricInfo (device, "realpower.input.L1", "W", 1, now, "", 300));
+            dc.setMeasurement (MetricInfo (device, "realpower.output.L1", "W", 10, now, "", 300));
+            dc.setMeasurement (MetricInfo (device, "realpower.output.L2", "W", 20, now, "", 300));
+            dc.setMeasurement (MetricInfo (device, "realpower.output.L3", "W", 30, now, "", 300));
+        }
+        uint32_t all = (1u << TPOWER_QUANTITY_COUNT) - 1;
+        TPUnit::QuantityValues values;
+        dc.totals (all, values);
+        assert (values[TPOWER_REALPOWER_DEFAULT] == 120);
+        assert (values[TPOWER_REALPOWER_INPUT_L1] == 2);
+        assert (std::isnan (values[TPOWER_REALPOWER_INPUT_L2]));
+        assert (values[TPOWER_REALPOWER_OUTPUT_L2] == 20);
+        // not requested
+        dc.totals (1u << TPOWER_REALPOWER_INPUT_L1, values);
+        assert (values[TPOWER_REALPOWER_INPUT_L1] == 2);
+        assert (std::isnan (values[TPOWER_REALPOWER_DEFAULT]));
+
+        dc.calculate (all);
+        assert (dc.get (TPOWER_REALPOWER_DEFAULT) == 120);
+        assert (dc.get (TPOWER_REALPOWER_OUTPUT_L3) == 30);
+        assert (dc.quantityIsUnknown (TPOWER_REALPOWER_INPUT_L3));
+
+        // single phase device makes output phases unknown
+        dc.setMeasurement (MetricInfo ("ups-2", "realpower.output.L2", "W", 20, now - 100, "", 10));
+        dc.dropOldMetricInfos ();
+        dc.calculate (all);
+        assert (dc.quantityIsUnknown (TPOWER_REALPOWER_OUTPUT_L1));
+        assert (dc.quantityIsUnknown (TPOWER_REALPOWER_OUTPUT_L2));
+        // phases of ups-2 are incomplete, the last known total stays
+        assert (dc.get (TPOWER_REALPOWER_DEFAULT) == 120);
+        auto unknown = dc.devicesInUnknownState (TPOWER_REALPOWER_OUTPUT_L2);
+        assert (unknown.size () == 1 && unknown[0] == "ups-2");
+
+        // adding the device again keeps its measurements
+        dc.addPowerDevice ("ups-1");
+        dc.totals (all, values);
+        assert (values[TPOWER_REALPOWER_INPUT_L1] == 2);
+
+        // new device is unknown until it reports
+        dc.addPowerDevice ("ups-3");
+        dc.totals (all, values);
+        assert (std::isnan (values[TPOWER_REALPOWER_INPUT_L1]));
+        dc.setMeasurement (MetricInfo ("ups-3", "realpower.input.L1", "W", 1, now, "", 300));
+        dc.totals (all, values);
+        assert (values[TPOWER_REALPOWER_INPUT_L1] == 3);
+    }
+
+    // unknown values are not exceptional
+    {
+        TPUnit empty;
+        empty.name ("rack-empty");
+        empty.addPowerDevice ("epdu-empty");
+        empty.calculate (TPOWER_REALPOWER_DEFAULT);
+        assert (std::isnan (empty.get (TPOWER_REALPOWER_DEFAULT)));
+        assert (empty.getMetricInfo (TPOWER_REALPOWER_DEFAULT).isUnknown ());
+    }
+
+    // output phases come from the last device by name, not by interning order
+    {
+        symbol ("ups-order-b");
+        symbol ("ups-order-a");
+        TPUnit rack;
+        rack.name ("rack-order");
+        rack.addPowerDevice ("ups-order-a");
+        rack.addPowerDevice ("ups-order-b");
+        uint64_t now = ::time (NULL);
+        rack.setMeasurement (MetricInfo ("ups-order-a", "realpower.output.L1", "W", 1, now, "", 300));
+        rack.setMeasurement (MetricInfo ("ups-order-b", "realpower.output.L1", "W", 2, now, "", 300));
+        rack.calculate (TPOWER_REALPOWER_OUTPUT_L1);
+        assert (rack.get (TPOWER_REALPOWER_OUTPUT_L1) == 2);
+    }
+
+    // offline device costs no more than the online one
+    if (verbose) {
+        printf ("\n    all devices online: %.0f ns/measurement", s_benchmark (false));
+        printf ("\n    one device offline: %.0f ns/measurement\n    ", s_benchmark (true));
+    }
+
+    printf ("OK\n");
 }
@@ -25,122 +25,213 @@
 #define TP_UNIT_H_INCLUDED
 
 #include <map>
+#include <unordered_map>
+#include <array>
 #include <string>
 #include <vector>
 #include <ctime>
 #include <functional>
+#include <cstdint>
+#include <cmath>
 
 #include "metriclist.h"
+#include "quantity.h"
+
+//! \brief when the total of a quantity is published
+struct TPowerPublishPolicy {
+    //! \brief minimal change of the value since the last publication [W]
+    double absoluteDeadband = 0.00001;
+    //! \brief minimal change relative to the last published value (0.05 = 5%)
+    double relativeDeadband = 0;
+    //! \brief republish unchanged value after this time [s], see TPOWER_MEASUREMENT_REPEAT_AFTER
+    uint64_t maxSilence = 300;
+};
 
 //! \brief class representing total power calculation unit (rack or DC)
 class TPUnit {
  public:
 
+    //\! \brief values per quantity (NAN if unknown)
+    typedef std::array< double, TPOWER_QUANTITY_COUNT > QuantityValues;
+
     //\! \brief calculate total value for all interesting quantities
-    void calculate(const std::vector<std::string> &quantities);
+    void calculate(const std::vector<TPowerQuantity> &quantities);
+    //\! \brief calculate total value for quantities (bit per TPowerQuantity) in one pass
+    void calculate(uint32_t quantities);
     //\! \brief calculate total value for one quantity
-    void calculate(const std::string &quantity);
+    void calculate(TPowerQuantity quantity);
+    /*! \brief compute totals of quantities (bit per TPowerQuantity) without storing them
+     *
+     * Running totals are read for all requested quantities at once, the
+     * phase compatibility of devices is evaluated once for all output phases.
+     * Quantities, which were not requested or can't be computed, are NAN.
+     */
+    void totals(uint32_t quantities, QuantityValues &values) const;
     //\! \brief discard obsolete measurements
     void dropOldMetricInfos();
 
-    //\! \brief get value of particular quantity. Method throws an exception if quantity is unknown.
-    double get( const std::string &quantity) const;
+    //\! \brief get value of particular quantity, NAN if quantity is unknown.
+    double get( TPowerQuantity quantity) const;
 
     //\! \brief set value of particular quantity.
-    // TODO const &
-    void set(const std::string &quantity, MetricInfo &measurement);
+    void set(TPowerQuantity quantity, const MetricInfo &measurement);
 
-    //\! \brief Metric Info per articular quantity.
-    MetricInfo getMetricInfo(const std::string &quantity) const;
+    //\! \brief Metric Info per articular quantity, isUnknown() if quantity is unknown.
+    MetricInfo getMetricInfo(TPowerQuantity quantity) const;
 
 
     //\! \brief get set unit name
-    std::string name() const { return _name; };
-    void name(const std::string &name) { _name = name; };
-    void name(const char *name) { _name =  name ? name : ""; };
+    const std::string &name() const { return symbolName(_name); };
+    Symbol nameId() const { return _name; };
+    void name(const std::string &name) { _name = symbol(name); };
+    void name(const char *name) { _name = SymbolTable::instance().intern(name); };
 
     //\! \brief returns true if at least one measurement of all included powerdevices is unknown
-    bool quantityIsUnknown( const std::string &quantity ) const;
+    bool quantityIsUnknown( TPowerQuantity quantity ) const;
     //\! \brief returns true if totalpower can be calculated.
-    bool quantityIsKnown( const std::string &quantity ) const {
+    bool quantityIsKnown( TPowerQuantity quantity ) const {
         return ! quantityIsUnknown(quantity);
     }
 
     //\! \brief returns list of devices in unknown state
-    std::vector<std::string> devicesInUnknownState(const std::string &quantity) const;
+    std::vector<std::string> devicesInUnknownState(TPowerQuantity quantity) const;
 
-    //\! \brief add powerdevice to unit
+    //\! \brief add powerdevice to unit, known powerdevice keeps its measurements
     void addPowerDevice(const std::string &device);
+    //\! \brief included powerdevices in order of addition
+    const std::vector<Symbol> &powerDevices() const { return _devices; };
 
     //\! \brief save new received measurement
     void setMeasurement(const MetricInfo &M);
 
     //! \brief returns true if measurement is changend and we should advertised
-    bool changed(const std::string &quantity) const;
+    bool changed(TPowerQuantity quantity) const;
 
     //! \brief set/clear changed status
-    void changed(const std::string &quantity, bool newStatus);
+    void changed(TPowerQuantity quantity, bool newStatus);
 
-    //! \brief returns true if measurement should be send (changed is true or we did not send it for long time)
-    bool advertise( const std::string &quantity ) const;
+    //! \brief returns true if measurement should be send (changed out of deadband or we did not send it for long time)
+    bool advertise( TPowerQuantity quantity ) const;
 
     //! \brief set timestamp of the last publishing moment
-    void advertised( const std::string &quantity );
+    void advertised( TPowerQuantity quantity );
+
+    //! \brief advertised value was not sent after all, advertise it again (unless other value was advertised since)
+    void notAdvertised( TPowerQuantity quantity, double value );
 
     //! \brief time to next advertisement [s]
-    int64_t timeToAdvertisement( const std::string &quantity ) const;
+    int64_t timeToAdvertisement( TPowerQuantity quantity ) const;
+
+    //! \brief absolute time [s], when quantity should be checked for advertisement again
+    uint64_t advertisementDue( TPowerQuantity quantity ) const;
+
+    //! \brief get/set time, for which the advertisement check of quantity is planned (0 = not planned)
+    uint64_t scheduled( TPowerQuantity quantity ) const;
+    void scheduled( TPowerQuantity quantity, uint64_t due );
 
     //! \brief return timestamp for quantity change
-    uint64_t timestamp( const std::string &quantity ) const;
+    uint64_t timestamp( TPowerQuantity quantity ) const;
+
+    //! \brief get/set publish policy of quantity
+    const TPowerPublishPolicy &policy( TPowerQuantity quantity ) const { return _policies[quantity]; };
+    void policy( TPowerQuantity quantity, const TPowerPublishPolicy &policy ) { _policies[quantity] = policy; };
  protected:
     //! \brief A list of the last measurement values:  topic -> MetricInfo
     MetricList _lastValue;
 
     //! \brief measurement status
-    std::map < std::string, bool > _changed;
+    std::array < bool, TPOWER_QUANTITY_COUNT > _changed {};
 
     //! \brief measurement change timestamp
-    std::map < std::string, uint64_t> _changetimestamp;
+    std::array < uint64_t, TPOWER_QUANTITY_COUNT > _changetimestamp {};
 
     //! \brief measurement advertisement timestamp
-    std::map < std::string, uint64_t> _advertisedtimestamp;
+    std::array < uint64_t, TPOWER_QUANTITY_COUNT > _advertisedtimestamp {};
+
+    //! \brief last advertised value
+    std::array < double, TPOWER_QUANTITY_COUNT > _advertisedvalue {};
+
+    //! \brief deadbands and republish period per quantity
+    std::array < TPowerPublishPolicy, TPOWER_QUANTITY_COUNT > _policies;
 
-    /*! \brief list of measurements for included devices
+    //! \brief planned advertisement check
+    std::array < uint64_t, TPOWER_QUANTITY_COUNT > _scheduledtimestamp {};
+
+    //! \brief start of the period, which is limited by maxSilence
+    uint64_t silenceStart( TPowerQuantity quantity ) const;
+
+    /*! \brief measurements of included devices, slot per device and quantity
+     *
+     * Device gets its slot in addPowerDevice. Measurement of quantity q of
+     * the device in slot d is _values[q][d] (timestamp and ttl likewise), so
+     * values of one quantity are contiguous and summed by tpowerReduce:
+     *
+     *     _values[realpower.default]   | device0 | device1 | ... |
+     *     _values[realpower.input.L1]  | device0 | device1 | ... |
+     *     ...
+     *
+     * Unknown or expired measurement is NAN.
+     */
+    std::array< std::vector< double >, TPOWER_QUANTITY_COUNT > _values;
+    std::array< std::vector< uint64_t >, TPOWER_QUANTITY_COUNT > _timestamps;
+    std::array< std::vector< uint64_t >, TPOWER_QUANTITY_COUNT > _ttls;
+    //! \brief slot -> powerdevice
+    std::vector< Symbol > _devices;
+    //! \brief powerdevice -> slot
+    std::unordered_map< Symbol, size_t > _deviceSlots;
+    //! \brief contribution of the device in slot to realpower.default running total
+    std::vector< double > _defaultContributions;
+    //! \brief slot of the lexicographically last device, it provides output phases
+    size_t _lastDevice = 0;
+    //! \brief the earliest expiration time of known measurements (it may be earlier)
+    uint64_t _nextExpiration = UINT64_MAX;
+
+    //! \brief running total of one quantity over all powerdevices
+    struct RunningTotal {
+        double sum = 0;
+        //! \brief number of powerdevices, which contribution is unknown
+        size_t unknown = 0;
+    };
+
+    /*! \brief running totals per quantity, updated by delta in setMeasurement
+     *  and when measurement expires
      *
-     *     map---device1---map---realpower.default---MetricInfo
-     *      |               +----realpower.input.L1--MetricInfo
-     *      |               +----realpower.input.L2--MetricInfo
-     *      |               +----realpower.input.L3--MetricInfo
-     *      +----device2-...
+     *  For realpower.default the contribution of the device is given by
+     *  defaultContribution() (default value or sum of output phases).
      */
-    std::map< std::string, MetricList> _powerdevices;
+    std::array< RunningTotal, TPOWER_QUANTITY_COUNT > _totals;
+
+    //! \brief number of powerdevices with known realpower.output.L2
+    size_t _threePhaseDevices = 0;
+
+    //! \brief number of delta updates of running totals since last full summation
+    uint64_t _totalUpdates = 0;
 
     //! \brief unit name
-    std::string _name;
-
-    //! \brief replace not present measurement with another
-    static const std::map<std::string,std::string> _emergencyReplacements;
-
-    //! \brief replace not present measurement with some algorithm
-    static const std::map<std::string,int> _calculations;
-
-    double getMetricValue(
-        const MetricList  &measurements,
-        const std::string &quantity,
-        const std::string &deviceName
-    ) const;
-
-    //\! \brief calculate simple sum over devices considering the replacement table
-    MetricInfo simpleSummarize(const std::string &quantity) const;
-    //\! \brief calculate realpower sum over devices
-    MetricInfo realpowerDefault(const std::string &quantity) const;
-    //\! send realpower output or null in case of phase incompatibilities
-    MetricInfo realpowerOutput(const std::string &quantity) const;
+    Symbol _name = SymbolTable::EMPTY;
+
+    //\! \brief contribution of the device to realpower.default: default value or sum of output phases
+    double defaultContribution(size_t slot) const;
+    //\! \brief all devices report output phases or none of them does
+    bool phasesCompatible() const;
+
+    //\! \brief move the contribution of one device in running total from before to after
+    void updateTotal(TPowerQuantity quantity, double before, double after);
+    //\! \brief update running totals after measurement of device changed from before to after
+    void deviceChanged(
+        size_t slot,
+        TPowerQuantity quantity,
+        double before,
+        double after
+    );
+    //\! \brief compute all running totals from scratch
+    void recalculateTotals();
 private:
-    std::string generateTopic (const std::string &quantity) const;
-
     // time to live of the generated metrics [s]
     static const uint64_t TTL = 6*60;
+
+    // running totals are summed from scratch after so many delta updates per device
+    static const uint64_t TOTALS_RESYNC_FACTOR = 1000;
 };
 void tp_unit_test(bool verbose);
 
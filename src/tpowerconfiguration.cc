@@ -33,55 +33,84 @@
 #include <exception>
 #include <errno.h>
 #include <fty_common_db_asset.h>
+#include <fty_common_asset_types.h>
 #include <fty_common_db_dbpath.h>
 #include <fty_common_str_defs.h>
 #include <fty_common.h>
 #include <algorithm>
 #include <stdlib.h>
+#include <inttypes.h>
+#include <cmath>
+#include <climits>
+#include <thread>
+
+int
+    tpower_env_int (const char *name, int defaultValue)
+{
+    const char *value = getenv (name);
+    if (value) {
+        char *end = NULL;
+        long result = strtol (value, &end, 10);
+        if (end != value && *end == '\0' && result >= 0 && result <= INT_MAX) {
+            return static_cast<int> (result);
+        }
+        log_warning ("ignoring %s='%s'", name, value);
+    }
+    return defaultValue;
+}
+
+TotalPowerConfiguration::
+    ~TotalPowerConfiguration ()
+{
+    if( _loaderThread.joinable() ) {
+        _loaderThread.join();
+    }
+}
+
+void TotalPowerConfiguration::
+    loadTopology(TPowerTopology &topology, power_assets_t &assets, size_t threads)
+{
+    int64_t start = zclock_mono();
+    // connect to the database
+    tntdb::Connection connection = tntdb::connectCached(DBConn::url);
+    // all assets at once, racks and DCs are computed from them
+    auto reply = select_power_assets (connection);
+    connection.close();
+    if( ! reply.status ) {
+        throw std::runtime_error(reply.msg);
+    }
+    assets = std::move(reply.item);
+    int64_t loaded = zclock_mono();
+    // racks and then DCs, each of them by all threads, so there are never
+    // more of them than configured
+    auto racks = select_devices_total_power (assets, persist::asset_type::RACK, threads);
+    auto dcs = select_devices_total_power (assets, persist::asset_type::DATACENTER, threads);
+    if( racks.status ) {
+        topology.racks = std::move(racks.item);
+    }
+    if( dcs.status ) {
+        topology.DCs = std::move(dcs.item);
+    }
+    log_info ("topology loaded SUCCESS in %" PRIi64 " ms (database %" PRIi64 " ms, "
+              "computation %" PRIi64 " ms by %zu threads): %zu assets, %zu racks, %zu DCs",
+              zclock_mono() - start, loaded - start, zclock_mono() - loaded, threads,
+              assets.elements.size(), topology.racks.size(), topology.DCs.size());
+}
 
 bool TotalPowerConfiguration::
     configure(void)
 {
-    // TODO should be rewritten, for usinf messages
     log_info ("loading power topology");
     try {
-        // remove old topology
-        _racks.clear();
-        _affectedRacks.clear();
-        _DCs.clear();
-        _affectedDCs.clear();
-
-        // connect to the database
-        tntdb::Connection connection = tntdb::connectCached(DBConn::url);
-        // reading racks
-        auto ret = select_devices_total_power_racks (connection);
-
-        if( ret.status ) {
-            for( auto &rack_it: ret.item ) {
-                log_info("rack '%s' powerdevices:", rack_it.first.c_str() );
-                auto &devices = rack_it.second;
-                for( auto &device_it: devices ) {
-                    log_info("         -'%s'", device_it.c_str() );
-                    addDeviceToMap(_racks, _affectedRacks, rack_it.first, device_it );
-                }
-            }
-        }
-        // reading DCs
-        ret = select_devices_total_power_dcs (connection);
-        if( ret.status ) {
-            for( auto &dc_it: ret.item ) {
-                log_info("DC '%s' powerdevices:", dc_it.first.c_str() );
-                auto &devices = dc_it.second;
-                for( auto &device_it: devices ) {
-                    log_info("         -'%s'", device_it.c_str() );
-                    addDeviceToMap(_DCs, _affectedDCs, dc_it.first, device_it );
-                }
-            }
-        }
-        connection.close();
+        TPowerTopology topology;
+        power_assets_t assets;
+        loadTopology(topology, assets, topologyThreads());
+        configure(topology);
+        // changes of assets are applied to them from now on
+        _assets = std::move(assets);
+        _hasAssets = true;
         // no reconfiguration should be scheduled
         _reconfigPending = 0;
-        log_info ("topology loaded SUCCESS");
         return true;
     } catch (const std::exception &e) {
         log_error("Failed to read configuration from database. Excepton caught: '%s'.", e.what ());
@@ -94,22 +123,359 @@ bool TotalPowerConfiguration::
     }
 }
 
+bool TotalPowerConfiguration::
+    configureInBackground()
+{
+    if( loading() ) {
+        return false;
+    }
+    log_info ("loading power topology in background");
+    // assets changed from now on are reloaded once more
+    _reconfigPending = 0;
+    _loaded.reset(new LoadedTopology());
+    LoadedTopology *loaded = _loaded.get();
+    size_t threads = topologyThreads();
+    // the thread is always joined before _loaded is released
+    _loaderThread = std::thread ([loaded, threads] () {
+        try {
+            loadTopology(loaded->topology, loaded->assets, threads);
+            loaded->success = true;
+        } catch (const std::exception &e) {
+            loaded->error = e.what();
+        } catch (...) {
+            loaded->error = "Unknown exception";
+        }
+        loaded->done.store(true, std::memory_order_release);
+    });
+    return true;
+}
+
+void TotalPowerConfiguration::
+    applyLoadedTopology()
+{
+    if( ! loading() || ! _loaded->done.load(std::memory_order_acquire) ) {
+        return;
+    }
+    _loaderThread.join();
+    std::unique_ptr<LoadedTopology> loaded(std::move(_loaded));
+    if( ! loaded->success ) {
+        log_error("Failed to read configuration from database. Excepton caught: '%s'.", loaded->error.c_str());
+        if( _reconfigPending == 0 ) {
+            _reconfigPending = ::time(NULL) + 60;
+        }
+        return;
+    }
+    int64_t start = zclock_mono();
+    configure(loaded->topology);
+    _assets = std::move(loaded->assets);
+    _hasAssets = true;
+    log_info ("topology applied in %" PRIi64 " ms", zclock_mono() - start);
+}
+
+//! \brief the same powerdevices in any order
+template <typename T>
+static bool
+    s_sameDevices(std::vector<T> a, std::vector<T> b)
+{
+    if( a.size() != b.size() ) {
+        return false;
+    }
+    std::sort(a.begin(), a.end());
+    std::sort(b.begin(), b.end());
+    return a == b;
+}
+
+void TotalPowerConfiguration::
+    buildUnits(
+        const std::map< std::string, std::vector<std::string> > &topology,
+        std::map< Symbol, TPUnit > &old,
+        std::map< Symbol, TPUnit > &elements,
+        std::unordered_map< Symbol, Symbol > &reverseMap,
+        const char *kind,
+        bool sharded)
+{
+    for( auto &unit_it: topology ) {
+        log_info("%s '%s' powerdevices:", kind, unit_it.first.c_str() );
+        for( auto &device_it: unit_it.second ) {
+            log_info("         -'%s'", device_it.c_str() );
+            if( sharded ) {
+                reverseMap[symbol(device_it)] = symbol(unit_it.first);
+            } else {
+                addDeviceToMap(elements, reverseMap, unit_it.first, device_it );
+            }
+        }
+    }
+    if( sharded ) {
+        return;
+    }
+    // measurements, advertised values and planned checks go with the unit
+    size_t kept = 0;
+    for( auto &element : elements ) {
+        auto previous = old.find(element.first);
+        if( previous != old.end() && s_sameDevices(previous->second.powerDevices(), element.second.powerDevices()) ) {
+            element.second = std::move(previous->second);
+            ++kept;
+        }
+    }
+    log_info("%zu of %zu %ss kept with their measurements", kept, elements.size(), kind);
+}
+
+void TotalPowerConfiguration::
+    configure(const TPowerTopology &topology)
+{
+    // changes in the old topology are published first
+    flushBatch();
+
+    // units are computed by shards in shards mode, the powerdevices are
+    // needed for the subject filter only
+    bool sharded = _shards != NULL;
+    std::map< Symbol, TPUnit > racks;
+    std::unordered_map< Symbol, Symbol > affectedRacks;
+    buildUnits(topology.racks, _racks, racks, affectedRacks, "rack", sharded);
+    std::map< Symbol, TPUnit > DCs;
+    std::unordered_map< Symbol, Symbol > affectedDCs;
+    buildUnits(topology.DCs, _DCs, DCs, affectedDCs, "DC", sharded);
+
+    // swap contents, _deadlines keep pointers to the maps, their entries
+    // of removed or recreated units are obsolete now
+    _racks.swap(racks);
+    _affectedRacks.swap(affectedRacks);
+    _DCs.swap(DCs);
+    _affectedDCs.swap(affectedDCs);
+    _topology = topology;
+    // assets are set by the caller, if it has them
+    _assets = power_assets_t();
+    _hasAssets = false;
+
+    applyPolicies(_racks, _policies.racks);
+    applyPolicies(_DCs, _policies.DCs);
+    buildSubjectFilter();
+    ++_topologyVersion;
+    if( _shards ) {
+        // units are computed by shards
+        _deadlines = decltype(_deadlines)();
+        _shards->publishPolicies(_policies);
+        _shards->configure(topology);
+    } else {
+        // units without any measurement are checked from time to time as well,
+        // kept units are planned already
+        scheduleAll(_racks, _rackQuantities);
+        scheduleAll(_DCs, _dcQuantities);
+    }
+}
+
+size_t TotalPowerConfiguration::
+    updateUnits(
+        const std::set<std::string> &units,
+        const std::map< std::string, std::vector<std::string> > &changed,
+        std::map< std::string, std::vector<std::string> > &topology,
+        std::map< Symbol, TPUnit > &elements,
+        std::unordered_map< Symbol, Symbol > &reverseMap,
+        const TPowerQuantityPolicies &policies,
+        const std::vector<TPowerQuantity> &quantities,
+        const char *kind,
+        std::vector<Symbol> &devices)
+{
+    static const std::vector<std::string> none;
+    size_t updated = 0;
+    for( auto &name : units ) {
+        auto after = changed.find(name);
+        const auto &newDevices = after == changed.end() ? none : after->second;
+        auto before = topology.find(name);
+        const auto &oldDevices = before == topology.end() ? none : before->second;
+        if( s_sameDevices(oldDevices, newDevices) ) {
+            continue;
+        }
+        // device can be moved to other unit, which is updated already
+        Symbol unit = symbol(name);
+        for( auto &device : oldDevices ) {
+            Symbol id = symbol(device);
+            auto owner = reverseMap.find(id);
+            if( owner != reverseMap.end() && owner->second == unit ) {
+                reverseMap.erase(owner);
+            }
+            devices.push_back(id);
+        }
+        elements.erase(unit);
+        log_info("%s '%s' powerdevices:", kind, name.c_str() );
+        for( auto &device : newDevices ) {
+            log_info("         -'%s'", device.c_str() );
+            if( _shards ) {
+                reverseMap[symbol(device)] = unit;
+            } else {
+                addDeviceToMap(elements, reverseMap, name, device);
+            }
+            devices.push_back(symbol(device));
+        }
+        auto element = elements.find(unit);
+        if( element != elements.end() ) {
+            for( size_t i = 0; i < TPOWER_QUANTITY_COUNT; ++i ) {
+                element->second.policy(static_cast<TPowerQuantity>(i), policies[i]);
+            }
+            for( auto quantity : quantities ) {
+                schedule(elements, *element, quantity);
+            }
+        }
+        if( after == changed.end() ) {
+            topology.erase(name);
+        } else {
+            topology[name] = newDevices;
+        }
+        ++updated;
+    }
+    return updated;
+}
+
+void TotalPowerConfiguration::
+    update(const std::set<std::string> &units, const TPowerTopology &changed)
+{
+    // changes in the old topology are published first
+    flushBatch();
+
+    // powerdevices of the units before the change, shards are routed by them
+    TPowerTopology before;
+    if( _shards ) {
+        for( auto &name : units ) {
+            auto rack = _topology.racks.find(name);
+            if( rack != _topology.racks.end() ) {
+                before.racks.insert(*rack);
+            }
+            auto dc = _topology.DCs.find(name);
+            if( dc != _topology.DCs.end() ) {
+                before.DCs.insert(*dc);
+            }
+        }
+    }
+    std::vector<Symbol> devices;
+    size_t updated =
+        updateUnits(units, changed.racks, _topology.racks, _racks, _affectedRacks,
+                    _policies.racks, _rackQuantities, "rack", devices) +
+        updateUnits(units, changed.DCs, _topology.DCs, _DCs, _affectedDCs,
+                    _policies.DCs, _dcQuantities, "DC", devices);
+    if( updated == 0 ) {
+        return;
+    }
+    for( auto device : devices ) {
+        updateSubjectFilter(device);
+    }
+    ++_topologyVersion;
+    if( _shards ) {
+        // only shards owning the units get the change
+        _shards->update(units, before, changed);
+    }
+}
+
+size_t TotalPowerConfiguration::
+    topologyThreads() const
+{
+    if( _topologyThreads > 0 ) {
+        return _topologyThreads;
+    }
+    unsigned cpus = std::thread::hardware_concurrency();
+    return cpus > 0 ? cpus : 1;
+}
+
+void TotalPowerConfiguration::
+    publishPolicies(const TPowerPublishPolicies &policies)
+{
+    _policies = policies;
+    applyPolicies(_racks, _policies.racks);
+    applyPolicies(_DCs, _policies.DCs);
+    if( _shards ) {
+        _shards->publishPolicies(_policies);
+    }
+}
+
+void TotalPowerConfiguration::
+    applyPolicies(
+        std::map< Symbol, TPUnit > &elements,
+        const TPowerQuantityPolicies &policies )
+{
+    for( auto &element : elements ) {
+        for( size_t i = 0; i < TPOWER_QUANTITY_COUNT; ++i ) {
+            element.second.policy(static_cast<TPowerQuantity>(i), policies[i]);
+        }
+    }
+}
+
+bool TotalPowerConfiguration::
+    parsePolicies(const char *text, TPowerQuantityPolicies &policies)
+{
+    if( !text ) {
+        return false;
+    }
+    TPowerQuantityPolicies result = policies;
+    const char *item = text;
+    while( *item ) {
+        const char *end = strchr(item, ',');
+        if( !end ) {
+            end = item + strlen(item);
+        }
+        // optional quantity name
+        const char *values = item;
+        const char *equals = static_cast<const char *>(memchr(item, '=', end - item));
+        TPowerQuantity quantity = TPOWER_QUANTITY_UNKNOWN;
+        if( equals ) {
+            quantity = tpowerQuantity(item, equals - item);
+            if( quantity == TPOWER_QUANTITY_UNKNOWN ) {
+                log_error("unknown quantity '%.*s' in publish policy", static_cast<int>(equals - item), item);
+                return false;
+            }
+            values = equals + 1;
+        }
+        // absolute[:relative[:maxSilence]], missing or empty fields are kept
+        std::string fields(values, end - values);
+        std::vector<std::string> field;
+        size_t start = 0;
+        while( true ) {
+            size_t colon = fields.find(':', start);
+            field.push_back(fields.substr(start, colon == std::string::npos ? colon : colon - start));
+            if( colon == std::string::npos ) break;
+            start = colon + 1;
+        }
+        double number[3] = { -1, -1, -1 };
+        bool valid = field.size() <= 3 && !fields.empty();
+        for( size_t f = 0; valid && f < field.size(); ++f ) {
+            if( field[f].empty() ) continue;
+            char *rest = NULL;
+            number[f] = strtod(field[f].c_str(), &rest);
+            valid = *rest == '\0' && number[f] >= 0 && !std::isnan(number[f]);
+        }
+        if( !valid || number[2] == 0 ) {
+            log_error("invalid publish policy '%s'", fields.c_str());
+            return false;
+        }
+        for( size_t i = 0; i < TPOWER_QUANTITY_COUNT; ++i ) {
+            if( quantity != TPOWER_QUANTITY_UNKNOWN && i != static_cast<size_t>(quantity) ) {
+                continue;
+            }
+            if( number[0] >= 0 ) result[i].absoluteDeadband = number[0];
+            if( number[1] >= 0 ) result[i].relativeDeadband = number[1];
+            if( number[2] >= 0 ) result[i].maxSilence = static_cast<uint64_t>(number[2]);
+        }
+        item = *end ? end + 1 : end;
+    }
+    policies = result;
+    return true;
+}
+
 void TotalPowerConfiguration::addDeviceToMap(
-    std::map< std::string, TPUnit > &elements,
-    std::map< std::string, std::string > &reverseMap,
+    std::map< Symbol, TPUnit > &elements,
+    std::unordered_map< Symbol, Symbol > &reverseMap,
     const std::string & owner,
     const std::string & device )
 {
-    auto element = elements.find(owner);
+    Symbol ownerId = symbol(owner);
+    auto element = elements.find(ownerId);
     if( element == elements.end() ) {
         auto box = TPUnit();
         box.name(owner);
         box.addPowerDevice(device);
-        elements[owner] = box;
+        elements[ownerId] = box;
     } else {
         element->second.addPowerDevice(device);
     }
-    reverseMap[device] = owner;
+    reverseMap[symbol(device)] = ownerId;
 }
 
 
@@ -124,6 +490,13 @@ void TotalPowerConfiguration::
         return;
     }
 
+    // assets in memory are complete, unless the topology is going to be read again
+    // (change made during the loading may be missing in the loaded snapshot)
+    if( _hasAssets && _reconfigPending == 0 && ! loading() && applyAsset(message) ) {
+        _timeout = getPollInterval();
+        return;
+    }
+
     // something is beeing reconfigured, let things to settle down
     if( _reconfigPending == 0 ) {
         log_info("Reconfiguration scheduled");
@@ -134,49 +507,209 @@ void TotalPowerConfiguration::
             operation.c_str());
 }
 
-bool TotalPowerConfiguration::isRackQuantity(const std::string &quantity) const
+bool TotalPowerConfiguration::
+    applyAsset(fty_proto_t *message)
 {
-    return std::find(_rackQuantities.begin(), _rackQuantities.end(),
-            quantity) != _rackQuantities.end();
+    int64_t start = zclock_mono();
+    std::string operation(fty_proto_operation(message));
+    power_asset_change_t change {};
+    change.name = fty_proto_name(message);
+    change.removed = operation == FTY_PROTO_ASSET_OP_DELETE || operation == FTY_PROTO_ASSET_OP_RETIRE;
+    if( ! change.removed ) {
+        const char *type = fty_proto_aux_string(message, "type", NULL);
+        if( ! type ) {
+            return false;
+        }
+        change.type_id = persist::type_to_typeid(type);
+        change.subtype_name = fty_proto_aux_string(message, "subtype", "");
+        change.subtype_id = persist::subtype_to_subtypeid(change.subtype_name);
+        change.active = streq(fty_proto_aux_string(message, "status", "active"), "active");
+        // parent_name.1 is the closest parent
+        for( int i = 1; ; ++i ) {
+            std::string key = "parent_name." + std::to_string(i);
+            const char *parent = fty_proto_aux_string(message, key.c_str(), NULL);
+            if( ! parent ) break;
+            change.parents.push_back(parent);
+        }
+        if( change.parents.empty() && ! streq(fty_proto_aux_string(message, "parent", "0"), "0") ) {
+            // parent without its name
+            return false;
+        }
+        for( int i = 1; ; ++i ) {
+            std::string key = "power_source." + std::to_string(i);
+            const char *source = fty_proto_ext_string(message, key.c_str(), NULL);
+            if( ! source ) break;
+            change.sources.push_back(source);
+        }
+        // new asset can't be powered by a link, which is not announced
+        change.has_sources = ! change.sources.empty() || operation == FTY_PROTO_ASSET_OP_CREATE;
+    }
+    std::set<std::string> containers;
+    if( ! apply_power_asset_change(_assets, change, containers) ) {
+        return false;
+    }
+    TPowerTopology changed;
+    auto racks = select_devices_total_power(_assets, persist::asset_type::RACK, containers);
+    changed.racks = std::move(racks.item);
+    auto dcs = select_devices_total_power(_assets, persist::asset_type::DATACENTER, containers);
+    changed.DCs = std::move(dcs.item);
+    update(containers, changed);
+    log_info("ASSET %s %s applied in %" PRIi64 " ms, %zu containers computed again",
+             change.name.c_str(), operation.c_str(), zclock_mono() - start, containers.size());
+    return true;
 }
 
-bool TotalPowerConfiguration::isDCQuantity(const std::string &quantity) const
+void TotalPowerConfiguration::updateSubjectFilter(Symbol device)
 {
-    return std::find(_dcQuantities.begin(), _dcQuantities.end(),
-            quantity) != _dcQuantities.end();
+    uint32_t quantities = 0;
+    if( _affectedRacks.count(device) ) {
+        for( auto quantity: _rackQuantities ) {
+            quantities |= 1u << quantity;
+        }
+    }
+    if( _affectedDCs.count(device) ) {
+        for( auto quantity: _dcQuantities ) {
+            quantities |= 1u << quantity;
+        }
+    }
+    if( quantities ) {
+        _subjectFilter[device] = quantities;
+    } else {
+        _subjectFilter.erase(device);
+    }
+}
+
+void TotalPowerConfiguration::buildSubjectFilter()
+{
+    _subjectFilter.clear();
+    for( auto &it: _affectedRacks ) {
+        for( auto quantity: _rackQuantities ) {
+            _subjectFilter[it.first] |= 1u << quantity;
+        }
+    }
+    for( auto &it: _affectedDCs ) {
+        for( auto quantity: _dcQuantities ) {
+            _subjectFilter[it.first] |= 1u << quantity;
+        }
+    }
+    log_info("subject filter: %zu powerdevices (accepted %" PRIu64 ", rejected %" PRIu64 " metrics so far)",
+        _subjectFilter.size(), _acceptedMetrics, _rejectedMetrics);
+}
+
+std::vector<std::string> TotalPowerConfiguration::subscriptions() const
+{
+    std::vector<std::string> result;
+    result.reserve(_subjectFilter.size());
+    for( auto &it: _subjectFilter ) {
+        result.push_back( subscriptionPattern( symbolName(it.first) ) );
+    }
+    return result;
+}
+
+std::string TotalPowerConfiguration::subscriptionPattern(const std::string &device)
+{
+    std::string result = "^realpower\\..*@";
+    for( char c: device ) {
+        if( c && strchr("\\^$.|?*+()[]{}", c) ) {
+            result += '\\';
+        }
+        result += c;
+    }
+    result += '$';
+    return result;
+}
+
+bool TotalPowerConfiguration::
+    isInteresting(const char *topic)
+{
+    // realpower.input.L3@epdu-42
+    const char *at = topic ? strchr(topic, '@') : NULL;
+    if( at ) {
+        TPowerQuantity quantity = tpowerQuantity(topic, at - topic);
+        if( quantity != TPOWER_QUANTITY_UNKNOWN ) {
+            // device, which was never interned, can't be in the topology
+            Symbol device = SymbolTable::instance().find(at + 1, strlen(at + 1));
+            auto it = _subjectFilter.find(device);
+            if( it != _subjectFilter.end() && ( it->second & ( 1u << quantity ) ) ) {
+                ++_acceptedMetrics;
+                return true;
+            }
+        }
+    }
+    ++_rejectedMetrics;
+    return false;
+}
+
+std::vector<TPowerQuantity> TotalPowerConfiguration::quantities(bool TPowerQuantityInfo::*flag)
+{
+    std::vector<TPowerQuantity> result;
+    for( int i = 0; i < TPOWER_QUANTITY_COUNT; ++i ) {
+        if( TPOWER_QUANTITIES[i].*flag ) {
+            result.push_back( static_cast<TPowerQuantity> (i) );
+        }
+    }
+    return result;
+}
+
+bool TotalPowerConfiguration::isRackQuantity(TPowerQuantity quantity) const
+{
+    return quantity != TPOWER_QUANTITY_UNKNOWN && TPOWER_QUANTITIES[quantity].rack;
+}
+
+bool TotalPowerConfiguration::isDCQuantity(TPowerQuantity quantity) const
+{
+    return quantity != TPOWER_QUANTITY_UNKNOWN && TPOWER_QUANTITIES[quantity].dc;
 }
 
 void TotalPowerConfiguration::
     processMetric (
         const MetricInfo &M,
-        const std::string &topic)
+        const char *topic)
 {
     // realpower.input.L3@epdu-42
-    std::string quantity = topic.substr(0, topic.find('@'));
+    const char *at = strchr(topic, '@');
+    size_t length = at ? at - topic : strlen(topic);
+    TPowerQuantity quantity = tpowerQuantity(topic, length);
+    processMetric(M, quantity);
+}
+
+void TotalPowerConfiguration::
+    processMetric (
+        const MetricInfo &M,
+        TPowerQuantity quantity)
+{
+    if( _shards ) {
+        _shards->processMetric(M, quantity);
+        return;
+    }
     // ASSUMTION: one device can affect only one ASSET of each type ( Datacenter or Rack )
     if (isRackQuantity(quantity)) {
-        auto affected_it = _affectedRacks.find( M.getElementName() );
+        auto affected_it = _affectedRacks.find( M.getElementId() );
         if( affected_it != _affectedRacks.end() ) {
             // this device affects some total rack power
-            log_trace("measurement is interesting for rack %s", affected_it->second.c_str() );
+            if( ManageFtyLog::getInstanceFtylog()->isLogTrace() ) {
+                log_trace("measurement is interesting for rack %s", symbolName(affected_it->second).c_str() );
+            }
             auto rack_it = _racks.find( affected_it->second );
             if( rack_it != _racks.end() ) {
                 // affected rack found
                 rack_it->second.setMeasurement(M);
-                sendMeasurement(*rack_it, quantity);
+                unitChanged(_racks, _dirtyRacks, *rack_it, quantity);
             }
         }
     }
     if (isDCQuantity(quantity)) {
-        auto affected_it = _affectedDCs.find( M.getElementName() );
+        auto affected_it = _affectedDCs.find( M.getElementId() );
         if( affected_it != _affectedDCs.end() ) {
             // this device affects some total DC power
-            log_trace("measurement is interesting for DC %s", affected_it->second.c_str() );
+            if( ManageFtyLog::getInstanceFtylog()->isLogTrace() ) {
+                log_trace("measurement is interesting for DC %s", symbolName(affected_it->second).c_str() );
+            }
             auto dc_it = _DCs.find( affected_it->second );
             if( dc_it != _DCs.end() ) {
                 // affected dc found
                 dc_it->second.setMeasurement(M);
-                sendMeasurement(*dc_it, quantity);
+                unitChanged(_DCs, _dirtyDCs, *dc_it, quantity);
             }
         }
     }
@@ -184,24 +717,109 @@ void TotalPowerConfiguration::
 }
 
 
+void TotalPowerConfiguration::
+    notPublished(const MetricInfo &M)
+{
+    TPowerQuantity quantity = tpowerQuantity(M.getSource().data(), M.getSource().size());
+    if( quantity == TPOWER_QUANTITY_UNKNOWN ) {
+        return;
+    }
+    for( auto elements: { &_racks, &_DCs } ) {
+        auto element = elements->find( M.getElementId() );
+        if( element != elements->end() ) {
+            // advertise it again in a second
+            element->second.notAdvertised(quantity, M.getValue());
+            schedule(*elements, *element, quantity, 0);
+        }
+    }
+    _timeout = getPollInterval();
+}
+
+void TotalPowerConfiguration::
+    batchingWindow(int64_t window)
+{
+    _batchingWindow = window > 0 ? window : 0;
+    if( _batchingWindow == 0 ) {
+        flushBatch();
+    }
+    _timeout = getPollInterval();
+}
+
+void TotalPowerConfiguration::
+    unitChanged(
+        std::map< Symbol, TPUnit > &elements,
+        std::unordered_map< Symbol, uint32_t > &dirty,
+        std::pair<const Symbol, TPUnit > &element,
+        TPowerQuantity quantity)
+{
+    if( _batchingWindow == 0 ) {
+        sendMeasurements(element, 1u << quantity);
+        schedule(elements, element, quantity);
+        return;
+    }
+    dirty[element.first] |= 1u << quantity;
+    if( _batchDue == 0 ) {
+        _batchDue = zclock_mono() + _batchingWindow;
+    }
+}
+
+void TotalPowerConfiguration::flushBatch()
+{
+    flushDirty(_racks, _dirtyRacks);
+    flushDirty(_DCs, _dirtyDCs);
+    _batchDue = 0;
+}
+
+void TotalPowerConfiguration::
+    flushDirty(
+        std::map< Symbol, TPUnit > &elements,
+        std::unordered_map< Symbol, uint32_t > &dirty)
+{
+    for( auto &it: dirty ) {
+        auto element = elements.find(it.first);
+        if( element == elements.end() ) {
+            continue;
+        }
+        sendMeasurements(*element, it.second);
+        for( int i = 0; i < TPOWER_QUANTITY_COUNT; ++i ) {
+            if( it.second & ( 1u << i ) ) {
+                schedule(elements, *element, static_cast<TPowerQuantity> (i));
+            }
+        }
+    }
+    dirty.clear();
+}
+
+void TotalPowerConfiguration::
+    sendMeasurements(
+        std::pair<const Symbol, TPUnit > &element,
+        uint32_t quantities)
+{
+    // only expired measurements are visited
+    element.second.dropOldMetricInfos();
+    // all quantities of the unit are computed at once
+    element.second.calculate( quantities );
+    for( int i = 0; i < TPOWER_QUANTITY_COUNT; ++i ) {
+        if( quantities & ( 1u << i ) ) {
+            sendMeasurement( element, static_cast<TPowerQuantity> (i) );
+        }
+    }
+}
+
 void TotalPowerConfiguration::
     sendMeasurement(
-        std::pair<const std::string, TPUnit > &element,
-        const std::string &quantity)
+        std::pair<const Symbol, TPUnit > &element,
+        TPowerQuantity quantity)
 {
     // renaming for better reading
     auto &powerUnit = element.second;
-    powerUnit.calculate( quantity );
     if( powerUnit.advertise(quantity) ) {
-        try {
-            MetricInfo M = powerUnit.getMetricInfo(quantity);
-            bool isSent = _sendingFunction(M);
-            if( isSent ) {
-                powerUnit.advertised(quantity);
-            }
-        } catch (...) {
-            log_error ("Some unexpected error during sending new measurement");
-        };
+        MetricInfo M = powerUnit.getMetricInfo(quantity);
+        if( M.isUnknown() ) {
+            log_error ("total %s of %s to advertise is unknown", tpowerQuantityName(quantity), powerUnit.name().c_str());
+        } else if( _sendingFunction(M) ) {
+            powerUnit.advertised(quantity);
+        }
     } else {
         // log something from time to time if device calculation is unknown
         auto devices = element.second.devicesInUnknownState(quantity);
@@ -212,58 +830,119 @@ void TotalPowerConfiguration::
             }
             log_info("%zd devices preventing total %s calculation for %s: %s",
                      devices.size(),
-                     quantity.c_str(),
-                     element.first.c_str(),
+                     tpowerQuantityName(quantity),
+                     powerUnit.name().c_str(),
                      devicesText.c_str() );
         }
     }
 }
 
 void TotalPowerConfiguration::
-    sendMeasurement(
-        std::map< std::string, TPUnit > &elements,
-        const std::vector<std::string> &quantities)
+    schedule(
+        std::map< Symbol, TPUnit > &elements,
+        std::pair<const Symbol, TPUnit > &element,
+        TPowerQuantity quantity)
+{
+    schedule(elements, element, quantity, element.second.advertisementDue(quantity));
+}
+
+void TotalPowerConfiguration::
+    schedule(
+        std::map< Symbol, TPUnit > &elements,
+        std::pair<const Symbol, TPUnit > &element,
+        TPowerQuantity quantity,
+        uint64_t due)
+{
+    auto &powerUnit = element.second;
+    uint64_t now = ::time(NULL);
+    if( due <= now ) {
+        // sending failed, try it again later
+        due = now + 1;
+    }
+    uint64_t planned = powerUnit.scheduled(quantity);
+    if( planned != 0 && planned <= due ) {
+        // it is planned earlier already, it will be planned again then
+        return;
+    }
+    powerUnit.scheduled(quantity, due);
+    _deadlines.push( Deadline { due, &elements, element.first, quantity } );
+}
+
+void TotalPowerConfiguration::
+    scheduleAll(
+        std::map< Symbol, TPUnit > &elements,
+        const std::vector<TPowerQuantity> &quantities)
 {
     for( auto &element : elements ) {
-        // XXX: This overload is called by onPoll() periodically, hence the
-        // purging
-        element.second.dropOldMetricInfos();
-        for (auto &quantity : quantities) {
-            sendMeasurement(element, quantity);
+        for( auto &quantity : quantities ) {
+            schedule(elements, element, quantity);
         }
     }
 }
 
 int64_t TotalPowerConfiguration::getPollInterval() {
     int64_t T = TPOWER_MEASUREMENT_REPEAT_AFTER; // result
-    for( auto &rack_it : _racks ) {
-        for( auto &q : _rackQuantities ) {
-            int64_t Tx = rack_it.second.timeToAdvertisement(q);
-            if( Tx > 0 && Tx < T ) {
-                T = Tx;
-            }
-        }
-    }
-    for( auto &dc_it : _racks ) {
-        for( auto &q : _dcQuantities ) {
-            int64_t Tx = dc_it.second.timeToAdvertisement(q);
-            if( Tx > 0 && Tx < T ) T = Tx;
-        }
+    int64_t now = ::time(NULL);
+    if( ! _deadlines.empty() ) {
+        int64_t Tx = static_cast<int64_t>(_deadlines.top().due) - now;
+        if( Tx < 0 ) Tx = 0;
+        if( Tx < T ) T = Tx;
     }
     if( _reconfigPending ) {
-        int64_t Tx = _reconfigPending - time(NULL) + 1;
+        int64_t Tx = _reconfigPending - now + 1;
         if( Tx <= 0 ) Tx = 1;
         if( Tx < T ) T = Tx;
     }
+    if( loading() ) {
+        // check every second, if the topology is read already
+        if( 1 < T ) T = 1;
+    }
+    if( _batchDue ) {
+        // dirty units are flushed before the end of batching window
+        int64_t Tx = _batchDue - zclock_mono();
+        if( Tx < 0 ) Tx = 0;
+        if( Tx < T * 1000 ) return Tx;
+    }
     return T * 1000;
 }
 
 
 void TotalPowerConfiguration::onPoll() {
-    sendMeasurement( _racks, _rackQuantities );
-    sendMeasurement( _DCs, _dcQuantities );
-    if( _reconfigPending && ( _reconfigPending <= ::time(NULL) ) ) {
-        configure();
+    // topology read in background is applied first, metrics are batched for it
+    applyLoadedTopology();
+    if( _batchDue && _batchDue <= zclock_mono() ) {
+        flushBatch();
+    }
+    uint64_t now = ::time(NULL);
+    // quantities (bit per TPowerQuantity) due per unit, computed in one pass
+    std::map< std::pair< std::map< Symbol, TPUnit > *, Symbol >, uint32_t > due;
+    while( ! _deadlines.empty() && _deadlines.top().due <= now ) {
+        Deadline deadline = _deadlines.top();
+        _deadlines.pop();
+
+        auto element = deadline.elements->find( deadline.unit );
+        if( element == deadline.elements->end() ||
+            element->second.scheduled( deadline.quantity ) != deadline.due )
+        {
+            // obsolete entry
+            continue;
+        }
+        element->second.scheduled( deadline.quantity, 0 );
+        due[ std::make_pair( deadline.elements, deadline.unit ) ] |= 1u << deadline.quantity;
+    }
+    for( auto &it : due ) {
+        auto &elements = *it.first.first;
+        auto &element = *elements.find( it.first.second );
+        sendMeasurements( element, it.second );
+        for( int i = 0; i < TPOWER_QUANTITY_COUNT; ++i ) {
+            if( it.second & ( 1u << i ) ) {
+                schedule( elements, element, static_cast<TPowerQuantity> (i) );
+            }
+        }
+    }
+    if( _reconfigPending && ( _reconfigPending <= ::time(NULL) ) && ! loading() ) {
+        // metrics are processed with the current topology meanwhile
+        configureInBackground();
     }
     _timeout = getPollInterval();
 }
@@ -276,5 +955,96 @@ void
 tpowerconfiguration_test (bool verbose)
 {
     printf (" * tpowerconfiguration: ");
+
+    assert (TotalPowerConfiguration::subscriptionPattern ("epdu-42") == "^realpower\\..*@epdu-42$");
+    assert (TotalPowerConfiguration::subscriptionPattern ("ups.1(a)") == "^realpower\\..*@ups\\.1\\(a\\)$");
+
+    // zero is a valid value (e.g. immediate recompute), garbage is not
+    setenv ("BIOS_TPOWER_SELFTEST", "0", 1);
+    assert (tpower_env_int ("BIOS_TPOWER_SELFTEST", 100) == 0);
+    setenv ("BIOS_TPOWER_SELFTEST", "10ms", 1);
+    assert (tpower_env_int ("BIOS_TPOWER_SELFTEST", 100) == 100);
+    setenv ("BIOS_TPOWER_SELFTEST", "-1", 1);
+    assert (tpower_env_int ("BIOS_TPOWER_SELFTEST", 100) == 100);
+    unsetenv ("BIOS_TPOWER_SELFTEST");
+
+    {
+        TPowerQuantityPolicies policies;
+        assert (policies[TPOWER_REALPOWER_DEFAULT].maxSilence == TPOWER_MEASUREMENT_REPEAT_AFTER);
+        assert (TotalPowerConfiguration::parsePolicies ("0:0.01,realpower.default=10::600", policies));
+        assert (policies[TPOWER_REALPOWER_DEFAULT].absoluteDeadband == 10);
+        assert (policies[TPOWER_REALPOWER_DEFAULT].relativeDeadband == 0.01);
+        assert (policies[TPOWER_REALPOWER_DEFAULT].maxSilence == 600);
+        assert (policies[TPOWER_REALPOWER_OUTPUT_L1].absoluteDeadband == 0);
+        assert (policies[TPOWER_REALPOWER_OUTPUT_L1].relativeDeadband == 0.01);
+        assert (policies[TPOWER_REALPOWER_OUTPUT_L1].maxSilence == TPOWER_MEASUREMENT_REPEAT_AFTER);
+        // errors don't change anything
+        assert (! TotalPowerConfiguration::parsePolicies ("voltage.default=1", policies));
+        assert (! TotalPowerConfiguration::parsePolicies ("1:2:3:4", policies));
+        assert (! TotalPowerConfiguration::parsePolicies ("1W", policies));
+        assert (! TotalPowerConfiguration::parsePolicies ("1::0", policies));
+        assert (! TotalPowerConfiguration::parsePolicies ("1,-1", policies));
+        assert (policies[TPOWER_REALPOWER_OUTPUT_L1].absoluteDeadband == 0);
+    }
+
+    {
+        // reconfiguration keeps measurements of units with the same powerdevices
+        std::map< std::string, double > published;
+        TotalPowerConfiguration config ([&published] (const MetricInfo &M) -> bool {
+            published[M.getElementName ()] = M.getValue ();
+            return true;
+        });
+        config.batchingWindow (0);
+        auto measure = [&config] (const char *device, double value) {
+            MetricInfo M (device, "realpower.default", "W", value, ::time (NULL), "", 300);
+            config.processMetric (M, TPOWER_REALPOWER_DEFAULT);
+        };
+        TPowerTopology topology;
+        topology.racks["rack-1"] = { "epdu-1", "epdu-2" };
+        topology.racks["rack-2"] = { "epdu-3" };
+        config.configure (topology);
+        assert (! config.loading ());
+        measure ("epdu-1", 100);
+        measure ("epdu-3", 10);
+        assert (published.count ("rack-1") == 0);
+        assert (published["rack-2"] == 10);
+
+        uint64_t version = config.topologyVersion ();
+        topology.racks["rack-1"] = { "epdu-2", "epdu-1" };
+        topology.racks["rack-2"] = { "epdu-3", "epdu-4" };
+        config.configure (topology);
+        assert (config.topologyVersion () == version + 1);
+        // epdu-1 is still known in rack-1
+        measure ("epdu-2", 50);
+        assert (published["rack-1"] == 150);
+        // rack-2 is new, epdu-3 is unknown there
+        published.clear ();
+        measure ("epdu-4", 5);
+        assert (published.count ("rack-2") == 0);
+        measure ("epdu-3", 20);
+        assert (published["rack-2"] == 25);
+
+        // only given units are updated
+        version = config.topologyVersion ();
+        TPowerTopology changed;
+        changed.racks["rack-2"] = { "epdu-4", "epdu-3" };
+        config.update ({ "rack-2" }, changed);
+        assert (config.topologyVersion () == version);
+        changed.racks["rack-3"] = { "epdu-5" };
+        config.update ({ "rack-1", "rack-3" }, changed);
+        assert (config.topologyVersion () == version + 1);
+        auto subscriptions = config.subscriptions ();
+        auto subscribed = [&subscriptions] (const char *device) {
+            return std::find (subscriptions.begin (), subscriptions.end (),
+                TotalPowerConfiguration::subscriptionPattern (device)) != subscriptions.end ();
+        };
+        assert (subscriptions.size () == 3);
+        assert (subscribed ("epdu-3") && subscribed ("epdu-4") && subscribed ("epdu-5"));
+        published.clear ();
+        measure ("epdu-1", 100);
+        measure ("epdu-5", 7);
+        assert (published.count ("rack-1") == 0);
+        assert (published["rack-3"] == 7);
+    }
     printf ("OK\n");
 }
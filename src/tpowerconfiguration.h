@@ -28,17 +28,55 @@
 #define TPOWERCONFIGURATION_H_INCLUDED
 
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <string>
+#include <queue>
 #include <functional>
+#include <array>
+#include <memory>
+#include <atomic>
+#include <thread>
+
+#include <set>
 
 #include "tp_unit.h"
+#include "calc_power.h"
 
 // TODO: read this from configuration (once in 5 minutes now (300s)) in [s]
 #define TPOWER_MEASUREMENT_REPEAT_AFTER 300
 // TODO: read this from configuration (check with upsd ever 5s) in [ms]
 #define TPOWER_POLLING_INTERVAL  5000
+// TODO: read this from configuration (environment BIOS_TPOWER_BATCHING_WINDOW
+// overrides it now), recompute changed units at most every 100ms, 0 = immediately, in [ms]
+#define TPOWER_BATCHING_WINDOW  100
+// TODO: read this from configuration (environment BIOS_TPOWER_RCVHWM/BIOS_TPOWER_SNDHWM
+// overrides it now), receive/send high-water marks of all sockets in [messages]
+#define TPOWER_CONSUMER_RCVHWM  10000
+#define TPOWER_PRODUCER_SNDHWM  1000
+// TODO: read this from configuration (environment BIOS_TPOWER_TOPOLOGY_THREADS
+// overrides it now), threads computing racks and DCs of the topology, 0 = number of CPUs
+#define TPOWER_TOPOLOGY_THREADS 0
+
+//! \brief non-negative integer from environment or default value
+int tpower_env_int (const char *name, int defaultValue);
+
+class TPowerShards;
+
+//! \brief publish policy for each quantity
+typedef std::array< TPowerPublishPolicy, TPOWER_QUANTITY_COUNT > TPowerQuantityPolicies;
 
+//! \brief publish policies of racks and DCs
+struct TPowerPublishPolicies {
+    TPowerQuantityPolicies racks;
+    TPowerQuantityPolicies DCs;
+};
+
+//! \brief power topology: rack or DC name -> its powerdevices
+struct TPowerTopology {
+    std::map< std::string, std::vector<std::string> > racks;
+    std::map< std::string, std::vector<std::string> > DCs;
+};
 
 class TotalPowerConfiguration {
 public:
@@ -47,17 +85,109 @@ public:
     {
         _sendingFunction = f;
     };
+    //! \brief waits for the background loading of topology
+    ~TotalPowerConfiguration ();
 
-    void processMetric (const MetricInfo &M, const std::string &topic);
+    void processMetric (const MetricInfo &M, const char *topic);
+    void processMetric (const MetricInfo &M, TPowerQuantity quantity);
+    /*! \brief check subject quantity@device of the metric before it is decoded
+     *
+     * \return true if the metric can affect some rack or DC
+     */
+    bool isInteresting (const char *topic);
+    /*! \brief apply change of asset to topology
+     *
+     * Only racks and DCs touched by the change are computed again. If the
+     * change can't be resolved from the assets in memory, the whole topology
+     * is read from database later.
+     */
     void processAsset (fty_proto_t *message);
+    //! \brief metric returned by the sending function as not sent after all, advertise it again
+    void notPublished (const MetricInfo &M);
     void onPoll();
-    //! \brief read configuration from database
+    //! \brief read configuration from database and apply it
     bool configure();
+    /*! \brief apply topology
+     *
+     * Units, which have the same powerdevices as in the previous topology,
+     * are kept with their measurements and advertisement state, so their
+     * totals stay known over the reconfiguration.
+     */
+    void configure(const TPowerTopology &topology);
+    /*! \brief read configuration from database in a background thread
+     *
+     * Metrics are processed meanwhile with the current topology, the new one
+     * is applied by onPoll() once it is read.
+     *
+     * \return false if the loading is running already
+     */
+    bool configureInBackground();
+    //! \brief true while the topology is read in background
+    bool loading() const { return _loaderThread.joinable(); };
+    /*! \brief read topology from database, throws on failure
+     *
+     * Doesn't touch any configuration, it can be called from any thread.
+     */
+    static void loadTopology(TPowerTopology &topology, power_assets_t &assets, size_t threads);
+    /*! \brief apply topology of some units, others are not changed
+     *
+     * Units, which are not in changed, are removed. Units with the same
+     * powerdevices as before are not touched at all.
+     */
+    void update(const std::set<std::string> &units, const TPowerTopology &changed);
+
+    /*! \brief aggregate in shard workers instead of this object (NULL = no shards)
+     *
+     * Metrics are routed to the shards and each topology is distributed to them.
+     */
+    void shards(TPowerShards *shards) { _shards = shards; };
 
     // in[ms]
     int64_t getTimeout(void) {
         return _timeout;
     };
+
+    /*! \brief get/set batching window [ms]
+     *
+     * Metrics only mark affected units as dirty and dirty units are
+     * recomputed and published once per window. 0 means recompute
+     * on every metric.
+     */
+    int64_t batchingWindow() const { return _batchingWindow; };
+    void batchingWindow(int64_t window);
+
+    //! \brief consumer patterns on METRICS stream for all powerdevices in topology
+    std::vector<std::string> subscriptions() const;
+    //! \brief consumer pattern on METRICS stream for realpower.* of one powerdevice
+    static std::string subscriptionPattern(const std::string &device);
+    //! \brief incremented each time the topology is loaded
+    uint64_t topologyVersion() const { return _topologyVersion; };
+
+    /*! \brief get/set number of threads computing power sources of racks and DCs
+     *
+     * Racks and DCs are computed at the same time, each by so many threads.
+     * 0 means number of CPUs.
+     */
+    size_t topologyThreads() const;
+    void topologyThreads(size_t threads) { _topologyThreads = threads; };
+
+    //! \brief get/set deadbands and republish periods of racks and DCs
+    const TPowerPublishPolicies &publishPolicies() const { return _policies; };
+    void publishPolicies(const TPowerPublishPolicies &policies);
+    /*! \brief parse policies in format [quantity=]absolute[:relative[:maxSilence]],...
+     *
+     * Item without quantity applies to all quantities, later items override
+     * earlier ones, so "0:0.01,realpower.default=10" is 1% for all quantities
+     * and 10W or 1% for realpower.default. Relative deadband is fraction of
+     * the last published value, maxSilence is in [s].
+     *
+     * \return false on parse error, policies are not changed then
+     */
+    static bool parsePolicies(const char *text, TPowerQuantityPolicies &policies);
+
+    //! \brief number of metrics accepted/rejected by isInteresting()
+    uint64_t acceptedMetrics() const { return _acceptedMetrics; };
+    uint64_t rejectedMetrics() const { return _rejectedMetrics; };
  private:
 
     /*
@@ -72,45 +202,153 @@ public:
 
     // in [ms]
     int64_t _timeout;
+    // in [ms]
+    int64_t _batchingWindow = TPOWER_BATCHING_WINDOW;
     //! \brief list of racks
-    std::map< std::string, TPUnit > _racks;
+    std::map< Symbol, TPUnit > _racks;
     //! \brief list of interested units
-    const std::vector<std::string> _rackQuantities = {
-        "realpower.default",
-    };
-    bool isRackQuantity(const std::string &quantity) const;
+    const std::vector<TPowerQuantity> _rackQuantities = quantities(&TPowerQuantityInfo::rack);
+    bool isRackQuantity(TPowerQuantity quantity) const;
     //! \brief list of racks, affected by powerdevice
-    std::map< std::string, std::string> _affectedRacks;
+    std::unordered_map< Symbol, Symbol > _affectedRacks;
 
     //! \brief list of datacenters
-    std::map< std::string, TPUnit > _DCs;
+    std::map< Symbol, TPUnit > _DCs;
     //! \brief list of interested units
-    const std::vector<std::string> _dcQuantities = {
-        "realpower.default",
-        "realpower.input.L1",
-        "realpower.input.L2",
-        "realpower.input.L3",
-        "realpower.output.L1",
-        "realpower.output.L2",
-        "realpower.output.L3",
-    };
-    bool isDCQuantity(const std::string &quantity) const;
+    const std::vector<TPowerQuantity> _dcQuantities = quantities(&TPowerQuantityInfo::dc);
+    bool isDCQuantity(TPowerQuantity quantity) const;
+
+    //! \brief list of quantities from registry, which have the flag set
+    static std::vector<TPowerQuantity> quantities(bool TPowerQuantityInfo::*flag);
     //! \brief list of DCs, affected by powerdevice
-    std::map< std::string, std::string> _affectedDCs;
+    std::unordered_map< Symbol, Symbol > _affectedDCs;
+
+    /*! \brief interesting quantities of each powerdevice (bit per TPowerQuantity)
+     *
+     * Rebuilt from _affectedRacks and _affectedDCs in configure().
+     */
+    std::unordered_map< Symbol, uint32_t > _subjectFilter;
+    //! \brief rebuild _subjectFilter from current topology
+    void buildSubjectFilter();
+    //! \brief update _subjectFilter of one powerdevice
+    void updateSubjectFilter(Symbol device);
+
+    uint64_t _topologyVersion = 0;
+    TPowerPublishPolicies _policies;
+    size_t _topologyThreads = TPOWER_TOPOLOGY_THREADS;
+    //! \brief set policies to all units
+    static void applyPolicies(
+        std::map< Symbol, TPUnit > &elements,
+        const TPowerQuantityPolicies &policies );
+    TPowerShards *_shards = NULL;
+    uint64_t _acceptedMetrics = 0;
+    uint64_t _rejectedMetrics = 0;
 
     //! \brief timestamp, when we should re-read configuration
     int64_t _reconfigPending = 0;
 
+    //! \brief result of the background loading, loader thread -> actor
+    struct LoadedTopology {
+        //! \brief set by the loader thread, when the rest is filled
+        std::atomic<bool> done {false};
+        bool success = false;
+        std::string error;
+        TPowerTopology topology;
+        power_assets_t assets;
+    };
+    std::unique_ptr<LoadedTopology> _loaded;
+    std::thread _loaderThread;
+    //! \brief apply the topology read in background, if it is read already
+    void applyLoadedTopology();
+
+    //! \brief current topology
+    TPowerTopology _topology;
+    //! \brief assets, which the topology is computed from (valid if _hasAssets)
+    power_assets_t _assets;
+    bool _hasAssets = false;
+    //! \brief apply change of asset to _assets and units, false if it can't be done locally
+    bool applyAsset(fty_proto_t *message);
+    //! \brief update units of one kind, touched powerdevices are added to devices
+    size_t updateUnits(
+        const std::set<std::string> &units,
+        const std::map< std::string, std::vector<std::string> > &changed,
+        std::map< std::string, std::vector<std::string> > &topology,
+        std::map< Symbol, TPUnit > &elements,
+        std::unordered_map< Symbol, Symbol > &reverseMap,
+        const TPowerQuantityPolicies &policies,
+        const std::vector<TPowerQuantity> &quantities,
+        const char *kind,
+        std::vector<Symbol> &devices );
+
+    //! \brief fill units and reverse map from topology, reuse unchanged units of old ones;
+    //!        sharded fills the reverse map only, units live in shards
+    static void buildUnits(
+        const std::map< std::string, std::vector<std::string> > &topology,
+        std::map< Symbol, TPUnit > &old,
+        std::map< Symbol, TPUnit > &elements,
+        std::unordered_map< Symbol, Symbol > &reverseMap,
+        const char *kind,
+        bool sharded );
+
+    //! \brief planned advertisement check of one quantity of one unit
+    struct Deadline {
+        uint64_t due;
+        std::map< Symbol, TPUnit > *elements;
+        Symbol unit;
+        TPowerQuantity quantity;
+
+        bool operator> (const Deadline &other) const { return due > other.due; }
+    };
+    /*! \brief min-heap of planned advertisement checks
+     *
+     * Entry is valid only if its due time is the same as TPUnit::scheduled(),
+     * other entries are obsolete and skipped.
+     */
+    std::priority_queue< Deadline, std::vector<Deadline>, std::greater<Deadline> > _deadlines;
+
+    //! \brief plan advertisement check of quantity for a unit (if not planned earlier already)
+    void schedule(
+        std::map< Symbol, TPUnit > &elements,
+        std::pair<const Symbol, TPUnit > &element,
+        TPowerQuantity quantity );
+    //! \brief plan advertisement check of quantity for a unit at due (at least in a second)
+    void schedule(
+        std::map< Symbol, TPUnit > &elements,
+        std::pair<const Symbol, TPUnit > &element,
+        TPowerQuantity quantity,
+        uint64_t due );
+    //! \brief plan advertisement check of all quantities for all units
+    void scheduleAll(
+        std::map< Symbol, TPUnit > &elements,
+        const std::vector<TPowerQuantity> &quantities );
+
+    //! \brief quantities (bit per TPowerQuantity) of units changed in current batch
+    std::unordered_map< Symbol, uint32_t > _dirtyRacks;
+    std::unordered_map< Symbol, uint32_t > _dirtyDCs;
+    //! \brief monotonic time [ms], when the current batch is flushed (0 = no batch)
+    int64_t _batchDue = 0;
+
+    //! \brief recompute quantity of a unit now or mark it dirty in batching mode
+    void unitChanged(
+        std::map< Symbol, TPUnit > &elements,
+        std::unordered_map< Symbol, uint32_t > &dirty,
+        std::pair<const Symbol, TPUnit > &element,
+        TPowerQuantity quantity );
+    //! \brief recompute and publish all dirty units
+    void flushBatch();
+    void flushDirty(
+        std::map< Symbol, TPUnit > &elements,
+        std::unordered_map< Symbol, uint32_t > &dirty );
 
-    //! \brief send measurement message if needed
-    void sendMeasurement(std::map< std::string, TPUnit > &elements, const std::vector<std::string> &quantities );
-    //! \brief send measurement message for a single unit if needed
-    void sendMeasurement(std::pair<const std::string, TPUnit > &element, const std::string &quantity );
+    //! \brief compute quantities (bit per TPowerQuantity) of a unit at once and send them if needed
+    void sendMeasurements(std::pair<const Symbol, TPUnit > &element, uint32_t quantities );
+    //! \brief send measurement message for a single unit if needed (computed already)
+    void sendMeasurement(std::pair<const Symbol, TPUnit > &element, TPowerQuantity quantity );
 
     //! \brief powerdevice to DC or rack and put it also in _affected* map
-    void addDeviceToMap(
-        std::map< std::string, TPUnit > &elements,
-        std::map< std::string, std::string > &reverseMap,
+    static void addDeviceToMap(
+        std::map< Symbol, TPUnit > &elements,
+        std::unordered_map< Symbol, Symbol > &reverseMap,
         const std::string & owner,
         const std::string & device );
 
@@ -0,0 +1,374 @@
+/*  =========================================================================
+    tpowerpublisher - Asynchronous publisher of computed metrics
+
+    Copyright (C) 2014 - 2018 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    tpowerpublisher - Asynchronous publisher of computed metrics
+@discuss
+    Slow mlm_client_send (broker backpressure) doesn't stall the computation.
+    The actor is woken by WAKE command only when it went idle, so there is
+    at most one command per burst of metrics.
+@end
+*/
+
+#include "fty_metric_tpower_classes.h"
+#include <fty_common_mlm_guards.h>
+#include <unordered_map>
+#include <algorithm>
+
+// Pre-encoded messages: (unit << 32 | quantity) -> template
+typedef std::unordered_map<uint64_t, MetricTemplate> MetricTemplates;
+
+// Template of the metric, created when needed
+static const MetricTemplate &
+    s_template (MetricTemplates &templates, const MetricInfo &M)
+{
+    uint64_t key = (static_cast<uint64_t> (M.getElementId ()) << 32) | M.getSourceId ();
+    auto it = templates.find (key);
+    if (it != templates.end () && !it->second.matches (M)) {
+        templates.erase (it);
+        it = templates.end ();
+    }
+    if (it == templates.end ()) {
+        it = templates.emplace (key, MetricTemplate (M)).first;
+    }
+    return it->second;
+}
+
+// Send metric using its template
+static bool
+    s_send (
+        mlm_client_t *client,
+        MetricTemplates &templates,
+        std::string &buffer,
+        const MetricInfo &M)
+{
+    const MetricTemplate &metricTemplate = s_template (templates, M);
+    if (!metricTemplate.valid ()) {
+        return send_metrics (client, M);
+    }
+    log_trace ("Metric is sent: topic = %s, value = %f", metricTemplate.topic ().c_str (), M.getValue ());
+    zmsg_t *msg = metricTemplate.encode (M, ::time (NULL), buffer);
+    return mlm_client_send (client, metricTemplate.topic ().c_str (), &msg) != -1;
+}
+
+// Send metrics of one unit as one message, frame per metric
+static bool
+    s_sendUnit (
+        mlm_client_t *client,
+        MetricTemplates &templates,
+        std::string &buffer,
+        std::vector<MetricInfo>::const_iterator begin,
+        std::vector<MetricInfo>::const_iterator end)
+{
+    uint64_t now = ::time (NULL);
+    zmsg_t *msg = zmsg_new ();
+    for (auto it = begin; it != end; ++it) {
+        const MetricTemplate &metricTemplate = s_template (templates, *it);
+        zmsg_t *metric;
+        if (metricTemplate.valid ()) {
+            metric = metricTemplate.encode (*it, now, buffer);
+        }
+        else {
+            char value [32];
+            formatValue (it->getValue (), value, sizeof (value));
+            metric = fty_proto_encode_metric (
+                NULL, now, it->getTtl (), it->getSource ().c_str (),
+                it->getElementName ().c_str (), value, it->getUnits ().c_str ());
+        }
+        zframe_t *frame = zmsg_pop (metric);
+        zmsg_append (msg, &frame);
+        zmsg_destroy (&metric);
+    }
+    std::string topic = "totals@" + begin->getElementName ();
+    log_trace ("Metrics are sent: topic = %s, count = %zu", topic.c_str (), zmsg_size (msg));
+    return mlm_client_send (client, topic.c_str (), &msg) != -1;
+}
+
+void
+    tpower_set_hwm (int sndhwm, int rcvhwm)
+{
+    if (sndhwm > 0) {
+        zsys_set_sndhwm (sndhwm);
+    }
+    if (rcvhwm > 0) {
+        zsys_set_rcvhwm (rcvhwm);
+        zsys_set_pipehwm (rcvhwm);
+    }
+}
+
+TPowerPublisher::
+    TPowerPublisher (const char *endpoint, const char *name, bool perUnit, size_t capacity) :
+    _endpoint (endpoint),
+    _name (name),
+    _perUnit (perUnit),
+    _queue (capacity),
+    _failed (capacity)
+{
+    _actor = zactor_new (tpowerpublisher_actor, this);
+}
+
+TPowerPublisher::
+    ~TPowerPublisher ()
+{
+    zactor_destroy (&_actor);
+}
+
+bool TPowerPublisher::
+    publish (const MetricInfo &M)
+{
+    if (!_queue.push (M)) {
+        ++_rejected;
+        return false;
+    }
+    // pairs with the fence in actor between going idle and checking the queue
+    std::atomic_thread_fence (std::memory_order_seq_cst);
+    if (_idle.exchange (false)) {
+        zstr_send (_actor, "WAKE");
+    }
+    return true;
+}
+
+void TPowerPublisher::
+    done (const MetricInfo &M, bool sent)
+{
+    if (sent) {
+        _sent.fetch_add (1, std::memory_order_relaxed);
+        return;
+    }
+    _notSent.fetch_add (1, std::memory_order_relaxed);
+    if (!_failed.push (M)) {
+        log_error ("metric %s was not sent and can't be returned",
+                M.generateTopic ().c_str ());
+    }
+}
+
+void
+tpowerpublisher_actor (zsock_t *pipe, void *args)
+{
+    TPowerPublisher *self = static_cast<TPowerPublisher *> (args);
+
+    MlmClientGuard client(mlm_client_new ());
+    bool connected = client &&
+        mlm_client_connect (client, self->_endpoint.c_str (), 1000, self->_name.c_str ()) >= 0 &&
+        mlm_client_set_producer (client, FTY_PROTO_STREAM_METRICS) >= 0;
+    if (!connected) {
+        // metrics are returned as failed
+        log_error ("%s: can't connect to malamute endpoint '%s'",
+                self->_name.c_str (), self->_endpoint.c_str ());
+    }
+    zsock_signal (pipe, 0);
+
+    MetricTemplates templates;
+    std::string buffer;
+    std::vector<MetricInfo> batch;
+    bool terminated = false;
+    while (!terminated) {
+        MetricInfo M;
+        while (self->_queue.pop (M)) {
+            if (self->_perUnit) {
+                batch.push_back (M);
+                continue;
+            }
+            bool sent = connected && s_send (client, templates, buffer, M);
+            if (sent) {
+                self->_messages.fetch_add (1, std::memory_order_relaxed);
+            }
+            self->done (M, sent);
+        }
+
+        if (!batch.empty ()) {
+            // metrics of one unit together, in the order they were published
+            std::stable_sort (batch.begin (), batch.end (),
+                [] (const MetricInfo &lhs, const MetricInfo &rhs) {
+                    return lhs.getElementId () < rhs.getElementId ();
+                });
+            auto begin = batch.cbegin ();
+            while (begin != batch.cend ()) {
+                auto end = begin;
+                while (end != batch.cend () && end->getElementId () == begin->getElementId ()) {
+                    ++end;
+                }
+                bool sent = connected && s_sendUnit (client, templates, buffer, begin, end);
+                if (sent) {
+                    self->_messages.fetch_add (1, std::memory_order_relaxed);
+                }
+                for (auto it = begin; it != end; ++it) {
+                    self->done (*it, sent);
+                }
+                begin = end;
+            }
+            batch.clear ();
+        }
+
+        self->_idle.store (true);
+        std::atomic_thread_fence (std::memory_order_seq_cst);
+        if (!self->_queue.empty ()) {
+            // published before it saw us idle
+            self->_idle.store (false);
+            continue;
+        }
+
+        char *command = zstr_recv (pipe);
+        terminated = !command || streq (command, "$TERM");
+        zstr_free (&command);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+// Publish all quantities of many DCs, returns number of received messages
+static size_t
+    s_benchmark (const char *endpoint, mlm_client_t *consumer, bool perUnit, bool verbose)
+{
+    static const int UNITS = 500;
+    TPowerPublisher publisher (endpoint, "tpowerpublisher-benchmark", perUnit, 8192);
+    uint64_t now = ::time (NULL);
+    int64_t start = zclock_usecs ();
+    for (int unit = 0; unit < UNITS; ++unit) {
+        std::string name = "dc-benchmark-" + std::to_string (unit);
+        for (int quantity = 0; quantity < TPOWER_QUANTITY_COUNT; ++quantity) {
+            MetricInfo M (name, TPOWER_QUANTITIES[quantity].name, "W", unit + quantity, now, "", 360);
+            while (!publisher.publish (M)) {
+                zclock_sleep (1);
+            }
+        }
+    }
+    size_t metrics = 0;
+    size_t messages = 0;
+    while (metrics < UNITS * TPOWER_QUANTITY_COUNT) {
+        zmsg_t *msg = mlm_client_recv (consumer);
+        assert (msg);
+        metrics += zmsg_size (msg);
+        ++messages;
+        zmsg_destroy (&msg);
+    }
+    int64_t elapsed = zclock_usecs () - start;
+    assert (metrics == UNITS * TPOWER_QUANTITY_COUNT);
+    if (verbose) {
+        printf ("\n    %s: %zu metrics in %zu messages, %.0f metrics/s, %.0f messages/s",
+            perUnit ? "per unit" : "per topic", metrics, messages,
+            metrics * 1e6 / elapsed, messages * 1e6 / elapsed);
+    }
+    return messages;
+}
+
+void
+tpowerpublisher_test (bool verbose)
+{
+    printf (" * tpowerpublisher: ");
+
+    // ring
+    {
+        TPowerRing<int> ring (3);
+        int item = 0;
+        assert (ring.empty ());
+        assert (!ring.pop (item));
+        for (int i = 0; i < 4; ++i) {
+            assert (ring.push (i));
+        }
+        assert (!ring.push (4));
+        for (int i = 0; i < 4; ++i) {
+            assert (ring.pop (item) && item == i);
+        }
+        assert (ring.empty ());
+        assert (ring.push (5) && ring.pop (item) && item == 5);
+    }
+
+    static const char* endpoint = "inproc://tpowerpublisher-test";
+    zactor_t *server = zactor_new (mlm_server, (void*) "Malamute");
+    zstr_sendx (server, "BIND", endpoint, NULL);
+
+    mlm_client_t *consumer = mlm_client_new ();
+    mlm_client_connect (consumer, endpoint, 1000, "tpowerpublisher-consumer");
+    mlm_client_set_consumer (consumer, FTY_PROTO_STREAM_METRICS, ".*");
+
+    MetricInfo M ("rack-publisher-test", "realpower.default", "W", 100, ::time (NULL), "", 300);
+    {
+        TPowerPublisher publisher (endpoint, "tpowerpublisher-test");
+        for (int i = 0; i < 3; ++i) {
+            assert (publisher.publish (M));
+        }
+        for (int i = 0; i < 3; ++i) {
+            zmsg_t *msg = mlm_client_recv (consumer);
+            assert (msg);
+            assert (M.generateTopic () == mlm_client_subject (consumer));
+            zmsg_destroy (&msg);
+        }
+        // counted after mlm_client_send returns
+        for (int i = 0; i < 100 && publisher.sent () < 3; ++i) {
+            zclock_sleep (10);
+        }
+        assert (publisher.sent () == 3);
+        MetricInfo F;
+        assert (!publisher.failed (F));
+    }
+
+    // metrics are returned, when they can't be sent
+    {
+        TPowerPublisher publisher ("inproc://tpowerpublisher-test-nobody", "tpowerpublisher-test");
+        assert (publisher.publish (M));
+        MetricInfo F;
+        for (int i = 0; i < 100 && !publisher.failed (F); ++i) {
+            zclock_sleep (50);
+        }
+        assert (F.generateTopic () == M.generateTopic ());
+        assert (publisher.notSent () == 1);
+    }
+
+    // metrics of one unit are coalesced into one message with frame per metric
+    {
+        TPowerPublisher publisher (endpoint, "tpowerpublisher-test", true);
+        MetricInfo L1 ("rack-publisher-test", "realpower.input.L1", "W", 30, ::time (NULL), "", 300);
+        assert (publisher.publish (M));
+        assert (publisher.publish (L1));
+        size_t frames = 0;
+        while (frames < 2) {
+            zmsg_t *msg = mlm_client_recv (consumer);
+            assert (msg);
+            assert (streq (mlm_client_subject (consumer), "totals@rack-publisher-test"));
+            for (zframe_t *frame = zmsg_first (msg); frame; frame = zmsg_next (msg)) {
+                zmsg_t *metric = zmsg_new ();
+                zmsg_addmem (metric, zframe_data (frame), zframe_size (frame));
+                MetricFrame decoded;
+                assert (decoded.decode (metric));
+                zmsg_destroy (&metric);
+                ++frames;
+            }
+            zmsg_destroy (&msg);
+        }
+        assert (frames == 2);
+    }
+
+    // message rate reduction
+    size_t perTopic = s_benchmark (endpoint, consumer, false, verbose);
+    size_t perUnit = s_benchmark (endpoint, consumer, true, verbose);
+    assert (perTopic == 500 * TPOWER_QUANTITY_COUNT);
+    assert (perUnit <= perTopic);
+    if (verbose) {
+        printf ("\n    ");
+    }
+
+    mlm_client_destroy (&consumer);
+    zactor_destroy (&server);
+    printf ("OK\n");
+}
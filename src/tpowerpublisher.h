@@ -0,0 +1,184 @@
+/*  =========================================================================
+    tpowerpublisher - Asynchronous publisher of computed metrics
+
+    Copyright (C) 2014 - 2018 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*! \file   tpowerpublisher.h
+ *  \brief  Publishing of metrics in own thread and malamute client
+ */
+
+#ifndef SRC_TPOWERPUBLISHER_H_
+#define SRC_TPOWERPUBLISHER_H_
+
+#include <czmq.h>
+#include <malamute.h>
+#include <atomic>
+#include <vector>
+#include <string>
+
+#include "metricinfo.h"
+
+//! \brief encode and send metric on METRICS stream, see fty_metric_tpower_server.cc
+bool send_metrics (mlm_client_t *client, const MetricInfo &M);
+
+/*
+ * \brief Set high-water marks of sockets created from now on (0 = keep zsys default)
+ *
+ * ZeroMQ takes the high-water marks from process-wide zsys defaults when the
+ * socket is created, so they are set once by main, before any actor or
+ * malamute client exists. rcvhwm applies to the actor and client pipes as well.
+ */
+void tpower_set_hwm (int sndhwm, int rcvhwm);
+
+/*
+ * \brief Bounded lock-free queue for one producer and one consumer thread
+ *
+ * Capacity is rounded up to the power of two.
+ */
+template <typename T>
+class TPowerRing {
+public:
+    explicit TPowerRing (size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        _slots.resize (size);
+        _mask = size - 1;
+    };
+
+    //! \brief producer: returns false if the ring is full
+    bool push (const T &item) {
+        size_t tail = _tail.load (std::memory_order_relaxed);
+        if (tail - _head.load (std::memory_order_acquire) == _slots.size ()) {
+            return false;
+        }
+        _slots[tail & _mask] = item;
+        _tail.store (tail + 1, std::memory_order_release);
+        return true;
+    };
+
+    //! \brief consumer: returns false if the ring is empty
+    bool pop (T &item) {
+        size_t head = _head.load (std::memory_order_relaxed);
+        if (head == _tail.load (std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move (_slots[head & _mask]);
+        _head.store (head + 1, std::memory_order_release);
+        return true;
+    };
+
+    bool empty (void) const {
+        return _head.load (std::memory_order_acquire) == _tail.load (std::memory_order_acquire);
+    };
+
+private:
+    std::vector<T> _slots;
+    size_t _mask;
+    // written by consumer resp. producer only, kept on own cache lines
+    std::atomic<size_t> _head {0};
+    char _padding[64];
+    std::atomic<size_t> _tail {0};
+};
+
+/*
+ * \brief Publisher of computed metrics
+ *
+ * publish() only puts the metric into the ring, the metric is encoded and
+ * sent by the publisher actor with its own malamute client. Metrics, which
+ * were not sent, are returned by failed(), so the caller can advertise them
+ * again.
+ *
+ * publish() and failed() must be called from one thread.
+ *
+ * In per unit mode, all metrics of one unit, which are drained from the
+ * queue at once, are sent as one message with subject totals@<unit>, each
+ * metric in its own frame (fty_proto METRIC). The default is one message
+ * per metric with subject <quantity>@<unit>, as existing consumers expect.
+ */
+class TPowerPublisher {
+public:
+    //! \brief default number of metrics waiting for publishing
+    static const size_t CAPACITY = 4096;
+
+    TPowerPublisher (
+        const char *endpoint,
+        const char *name,
+        bool perUnit = false,
+        size_t capacity = CAPACITY);
+    ~TPowerPublisher ();
+
+    //! \brief queue metric for publishing, returns false if the queue is full
+    bool publish (const MetricInfo &M);
+
+    //! \brief returns false if there is no metric, which failed to be sent
+    bool failed (MetricInfo &M) {
+        return _failed.pop (M);
+    };
+
+    //! \brief number of metrics refused by publish(), because the queue was full
+    uint64_t rejected (void) const {
+        return _rejected;
+    };
+
+    //! \brief number of messages sent by the actor
+    uint64_t messages (void) const {
+        return _messages.load (std::memory_order_relaxed);
+    };
+
+    //! \brief number of metrics sent/not sent by the actor
+    uint64_t sent (void) const {
+        return _sent.load (std::memory_order_relaxed);
+    };
+    uint64_t notSent (void) const {
+        return _notSent.load (std::memory_order_relaxed);
+    };
+
+private:
+    TPowerPublisher (const TPowerPublisher &) = delete;
+    TPowerPublisher &operator= (const TPowerPublisher &) = delete;
+
+    friend void tpowerpublisher_actor (zsock_t *pipe, void *args);
+
+    //! \brief actor: count the metric, return it to failed() if it was not sent
+    void done (const MetricInfo &M, bool sent);
+
+    std::string _endpoint;
+    std::string _name;
+    bool _perUnit;
+    //! \brief metrics to publish, computation -> actor
+    TPowerRing<MetricInfo> _queue;
+    //! \brief metrics, which were not sent, actor -> computation
+    TPowerRing<MetricInfo> _failed;
+    //! \brief actor is going to wait for WAKE command
+    std::atomic<bool> _idle {false};
+    std::atomic<uint64_t> _sent {0};
+    std::atomic<uint64_t> _notSent {0};
+    std::atomic<uint64_t> _messages {0};
+    uint64_t _rejected = 0;
+    zactor_t *_actor = NULL;
+};
+
+//! \brief actor sending metrics of TPowerPublisher passed in args
+void tpowerpublisher_actor (zsock_t *pipe, void *args);
+
+void tpowerpublisher_test (bool verbose);
+
+#endif // SRC_TPOWERPUBLISHER_H_
@@ -0,0 +1,247 @@
+/*  =========================================================================
+    tpowerreduce - Vectorized reduction of unit values
+
+    Copyright (C) 2014 - 2018 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    tpowerreduce - Vectorized reduction of unit values
+@discuss
+    Running totals of units are summed from scratch, when a powerdevice is
+    added and periodically to drop rounding errors. Values of one quantity
+    of all devices are contiguous (see TPUnit), so the sum and the number
+    of known values are computed in one vector sweep. NAN lanes are masked
+    out by ordered comparison of the value with itself.
+
+    SSE2 and AVX2 kernels are compiled with target attributes, so the rest
+    of the project doesn't need any special compiler flags, and selected at
+    runtime according to the CPU.
+@end
+*/
+
+#include "fty_metric_tpower_classes.h"
+#include <cmath>
+#include <vector>
+#include <random>
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#define TPOWER_REDUCE_X86
+#include <immintrin.h>
+#endif
+
+static TPowerReduction
+    s_reduceScalar (const double *values, size_t count)
+{
+    TPowerReduction result;
+    for (size_t i = 0; i < count; ++i) {
+        if (!std::isnan (values[i])) {
+            result.sum += values[i];
+            ++result.valid;
+        }
+    }
+    return result;
+}
+
+#ifdef TPOWER_REDUCE_X86
+
+__attribute__ ((target ("sse2"))) static TPowerReduction
+    s_reduceSSE2 (const double *values, size_t count)
+{
+    // two accumulators to hide the latency of additions
+    __m128d sum0 = _mm_setzero_pd ();
+    __m128d sum1 = _mm_setzero_pd ();
+    size_t valid = 0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128d a = _mm_loadu_pd (values + i);
+        __m128d b = _mm_loadu_pd (values + i + 2);
+        // all ones for lanes, which are not NAN
+        __m128d maskA = _mm_cmpord_pd (a, a);
+        __m128d maskB = _mm_cmpord_pd (b, b);
+        sum0 = _mm_add_pd (sum0, _mm_and_pd (a, maskA));
+        sum1 = _mm_add_pd (sum1, _mm_and_pd (b, maskB));
+        valid += __builtin_popcount (_mm_movemask_pd (maskA)) +
+                 __builtin_popcount (_mm_movemask_pd (maskB));
+    }
+    double lanes[2];
+    _mm_storeu_pd (lanes, _mm_add_pd (sum0, sum1));
+    TPowerReduction result = s_reduceScalar (values + i, count - i);
+    result.sum += lanes[0] + lanes[1];
+    result.valid += valid;
+    return result;
+}
+
+__attribute__ ((target ("avx2"))) static TPowerReduction
+    s_reduceAVX2 (const double *values, size_t count)
+{
+    __m256d sum0 = _mm256_setzero_pd ();
+    __m256d sum1 = _mm256_setzero_pd ();
+    size_t valid = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256d a = _mm256_loadu_pd (values + i);
+        __m256d b = _mm256_loadu_pd (values + i + 4);
+        __m256d maskA = _mm256_cmp_pd (a, a, _CMP_ORD_Q);
+        __m256d maskB = _mm256_cmp_pd (b, b, _CMP_ORD_Q);
+        sum0 = _mm256_add_pd (sum0, _mm256_and_pd (a, maskA));
+        sum1 = _mm256_add_pd (sum1, _mm256_and_pd (b, maskB));
+        valid += __builtin_popcount (_mm256_movemask_pd (maskA)) +
+                 __builtin_popcount (_mm256_movemask_pd (maskB));
+    }
+    double lanes[4];
+    _mm256_storeu_pd (lanes, _mm256_add_pd (sum0, sum1));
+    // the rest is shorter than 8 values
+    TPowerReduction result = s_reduceSSE2 (values + i, count - i);
+    result.sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    result.valid += valid;
+    return result;
+}
+
+#endif // TPOWER_REDUCE_X86
+
+bool
+    tpowerReduceSupported (TPowerReduceKernel kernel)
+{
+    switch (kernel) {
+    case TPOWER_REDUCE_SCALAR:
+        return true;
+#ifdef TPOWER_REDUCE_X86
+    case TPOWER_REDUCE_SSE2:
+        __builtin_cpu_init ();
+        return __builtin_cpu_supports ("sse2");
+    case TPOWER_REDUCE_AVX2:
+        __builtin_cpu_init ();
+        return __builtin_cpu_supports ("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+TPowerReduceKernel
+    tpowerReduceKernel (void)
+{
+    // selected once, initialization of static is thread safe
+    static const TPowerReduceKernel kernel =
+        tpowerReduceSupported (TPOWER_REDUCE_AVX2) ? TPOWER_REDUCE_AVX2 :
+        tpowerReduceSupported (TPOWER_REDUCE_SSE2) ? TPOWER_REDUCE_SSE2 :
+        TPOWER_REDUCE_SCALAR;
+    return kernel;
+}
+
+const char *
+    tpowerReduceKernelName (TPowerReduceKernel kernel)
+{
+    switch (kernel) {
+    case TPOWER_REDUCE_SCALAR: return "scalar";
+    case TPOWER_REDUCE_SSE2:   return "sse2";
+    case TPOWER_REDUCE_AVX2:   return "avx2";
+    }
+    return "unknown";
+}
+
+TPowerReduction
+    tpowerReduce (TPowerReduceKernel kernel, const double *values, size_t count)
+{
+    switch (kernel) {
+#ifdef TPOWER_REDUCE_X86
+    case TPOWER_REDUCE_SSE2:
+        return s_reduceSSE2 (values, count);
+    case TPOWER_REDUCE_AVX2:
+        return s_reduceAVX2 (values, count);
+#endif
+    default:
+        return s_reduceScalar (values, count);
+    }
+}
+
+TPowerReduction
+    tpowerReduce (const double *values, size_t count)
+{
+    return tpowerReduce (tpowerReduceKernel (), values, count);
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+// Sum of many values by kernel, returns ns per value
+static double
+    s_benchmark (TPowerReduceKernel kernel, const std::vector<double> &values)
+{
+    static const int ROUNDS = 200;
+    volatile double sink = 0;
+    int64_t start = zclock_usecs ();
+    for (int round = 0; round < ROUNDS; ++round) {
+        sink = sink + tpowerReduce (kernel, values.data (), values.size ()).sum;
+    }
+    int64_t elapsed = zclock_usecs () - start;
+    return elapsed * 1000.0 / ROUNDS / values.size ();
+}
+
+void
+tpowerreduce_test (bool verbose)
+{
+    printf (" * tpowerreduce: ");
+
+    assert (tpowerReduceSupported (tpowerReduceKernel ()));
+    TPowerReduction empty = tpowerReduce (NULL, 0);
+    assert (empty.sum == 0 && empty.valid == 0);
+
+    // integral values, so the sum is exact in any order
+    std::mt19937 random (42);
+    std::vector<double> values (1000);
+    for (auto &value : values) {
+        value = random () % 4 ? static_cast<double> (random () % 1000) : NAN;
+    }
+    for (int k = TPOWER_REDUCE_SCALAR; k <= TPOWER_REDUCE_AVX2; ++k) {
+        TPowerReduceKernel kernel = static_cast<TPowerReduceKernel> (k);
+        if (!tpowerReduceSupported (kernel)) {
+            continue;
+        }
+        // all lengths of the tail and unaligned starts
+        for (size_t start = 0; start < 3; ++start) {
+            for (size_t count = 0; count + start <= 40; ++count) {
+                TPowerReduction expected = tpowerReduce (TPOWER_REDUCE_SCALAR, &values[start], count);
+                TPowerReduction result = tpowerReduce (kernel, &values[start], count);
+                assert (result.sum == expected.sum);
+                assert (result.valid == expected.valid);
+            }
+        }
+        TPowerReduction expected = tpowerReduce (TPOWER_REDUCE_SCALAR, values.data (), values.size ());
+        TPowerReduction result = tpowerReduce (kernel, values.data (), values.size ());
+        assert (result.sum == expected.sum && result.valid == expected.valid);
+        assert (result.valid < values.size ());
+    }
+
+    // microbenchmark against the scalar path
+    if (verbose) {
+        std::vector<double> many (10000);
+        for (auto &value : many) {
+            value = random () % 100 ? (random () % 100000) / 10.0 : NAN;
+        }
+        for (int k = TPOWER_REDUCE_SCALAR; k <= TPOWER_REDUCE_AVX2; ++k) {
+            TPowerReduceKernel kernel = static_cast<TPowerReduceKernel> (k);
+            if (tpowerReduceSupported (kernel)) {
+                printf ("\n    %s: %.3f ns/value", tpowerReduceKernelName (kernel), s_benchmark (kernel, many));
+            }
+        }
+        printf ("\n    selected %s\n    ", tpowerReduceKernelName (tpowerReduceKernel ()));
+    }
+    printf ("OK\n");
+}
@@ -0,0 +1,69 @@
+/*  =========================================================================
+    tpowerreduce - Vectorized reduction of unit values
+
+    Copyright (C) 2014 - 2018 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*! \file   tpowerreduce.h
+ *  \brief  Sum of values with NAN as unknown, SIMD with runtime dispatch
+ */
+
+#ifndef SRC_TPOWERREDUCE_H_
+#define SRC_TPOWERREDUCE_H_
+
+#include <cstddef>
+
+//! \brief result of the reduction
+struct TPowerReduction {
+    //! \brief sum of values, which are not NAN
+    double sum = 0;
+    //! \brief number of values, which are not NAN (count - valid are unknown)
+    size_t valid = 0;
+};
+
+//! \brief implementations of the reduction
+enum TPowerReduceKernel {
+    TPOWER_REDUCE_SCALAR = 0,
+    TPOWER_REDUCE_SSE2,
+    TPOWER_REDUCE_AVX2,
+};
+
+/*
+ * \brief Sum and count of valid values in one sweep
+ *
+ * The best kernel supported by the CPU is selected on the first call.
+ * Order of additions depends on the kernel, so the sum can differ in
+ * rounding from the plain loop.
+ */
+TPowerReduction tpowerReduce (const double *values, size_t count);
+
+//! \brief reduction by given kernel, it must be supported (see tpowerReduceSupported)
+TPowerReduction tpowerReduce (TPowerReduceKernel kernel, const double *values, size_t count);
+
+//! \brief true if CPU supports the kernel
+bool tpowerReduceSupported (TPowerReduceKernel kernel);
+
+//! \brief kernel used by tpowerReduce (values, count)
+TPowerReduceKernel tpowerReduceKernel (void);
+
+const char *tpowerReduceKernelName (TPowerReduceKernel kernel);
+
+void
+tpowerreduce_test (bool verbose);
+
+#endif // SRC_TPOWERREDUCE_H_
@@ -0,0 +1,484 @@
+/*  =========================================================================
+    tpowershards - Sharded aggregation in worker actors
+
+    Copyright (C) 2014 - 2018 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    tpowershards - Sharded aggregation in worker actors
+@discuss
+    Agent actor decodes and filters metrics, shards compute the totals.
+    Objects are passed between threads by pointer (zsock_send "p"), the
+    receiver takes the ownership. ZeroMQ inproc pipes are lock-free queues.
+@end
+*/
+
+#include "fty_metric_tpower_classes.h"
+#include <memory>
+#include <functional>
+#include <algorithm>
+
+// Pointer passed in the next frame of the message
+static void *
+    s_popPointer (zmsg_t *msg)
+{
+    void *pointer = NULL;
+    zframe_t *frame = zmsg_pop (msg);
+    if (frame && zframe_size (frame) == sizeof (void *)) {
+        memcpy (&pointer, zframe_data (frame), sizeof (void *));
+    }
+    zframe_destroy (&frame);
+    return pointer;
+}
+
+// Metrics of PUBLISH message are appended, the message is destroyed
+static bool
+    s_popPublished (zmsg_t **msg_p, std::vector<MetricInfo> &metrics)
+{
+    zmsg_t *msg = *msg_p;
+    bool result = false;
+    char *command = zmsg_popstr (msg);
+    if (command && streq (command, "PUBLISH")) {
+        std::unique_ptr< std::vector<MetricInfo> > published (
+            static_cast< std::vector<MetricInfo> * > (s_popPointer (msg)));
+        if (published) {
+            metrics.insert (metrics.end (), published->begin (), published->end ());
+            result = true;
+        }
+    }
+    else {
+        log_error ("unexpected message '%s' from shard", command ? command : "");
+    }
+    zstr_free (&command);
+    zmsg_destroy (msg_p);
+    return result;
+}
+
+TPowerShards::
+    TPowerShards (size_t count, int64_t batchingWindow)
+{
+    if (count < 1) {
+        count = 1;
+    }
+    if (count > MAX_SHARDS) {
+        count = MAX_SHARDS;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        // zactor_new waits until the actor has read the argument
+        _actors.push_back (zactor_new (tpowershards_actor, &batchingWindow));
+    }
+    _pending.resize (count);
+    _notSent.resize (count);
+}
+
+TPowerShards::
+    ~TPowerShards ()
+{
+    for (auto &actor : _actors) {
+        // worker sends its last PUBLISH and signals, everything up to the
+        // signal is read, so no metrics are leaked; shard, which is gone
+        // already, doesn't get the $TERM
+        zsock_set_sndtimeo (actor, 0);
+        if (zstr_send (actor, "$TERM") == 0) {
+            std::vector<MetricInfo> ignored;
+            while (true) {
+                zmsg_t *msg = zmsg_recv (actor);
+                if (!msg) {
+                    break;
+                }
+                if (zmsg_signal (msg) >= 0) {
+                    zmsg_destroy (&msg);
+                    break;
+                }
+                s_popPublished (&msg, ignored);
+            }
+        }
+        zactor_destroy (&actor);
+    }
+}
+
+void TPowerShards::
+    configure (const TPowerTopology &topology)
+{
+    // metrics routed by the old topology go first
+    flush ();
+
+    _routes.clear ();
+    _owners.clear ();
+    std::vector<TPowerTopology *> parts;
+    for (size_t i = 0; i < size (); ++i) {
+        parts.push_back (new TPowerTopology ());
+    }
+    for (auto &rack : topology.racks) {
+        size_t shard = shardOf (rack.first, size ());
+        parts[shard]->racks.insert (rack);
+        for (auto &device : rack.second) {
+            route (symbol (device), shard, true);
+        }
+    }
+    for (auto &dc : topology.DCs) {
+        size_t shard = shardOf (dc.first, size ());
+        parts[shard]->DCs.insert (dc);
+        for (auto &device : dc.second) {
+            route (symbol (device), shard, true);
+        }
+    }
+    // every shard gets its part, even the empty one
+    for (size_t i = 0; i < size (); ++i) {
+        zsock_send (_actors[i], "sp", "TOPOLOGY", parts[i]);
+    }
+}
+
+void TPowerShards::
+    update (
+        const std::set<std::string> &units,
+        const TPowerTopology &before,
+        const TPowerTopology &changed)
+{
+    // metrics routed by the old topology go first
+    flush ();
+
+    std::vector<TPowerShardUpdate *> parts (size (), NULL);
+    auto move = [this, &parts] (
+        const std::string &name,
+        const std::map< std::string, std::vector<std::string> > &old,
+        const std::map< std::string, std::vector<std::string> > &now,
+        std::map< std::string, std::vector<std::string> > TPowerTopology::*kind)
+    {
+        auto previous = old.find (name);
+        auto next = now.find (name);
+        if (previous == old.end () && next == now.end ()) {
+            return;
+        }
+        size_t shard = shardOf (name, size ());
+        if (!parts[shard]) {
+            parts[shard] = new TPowerShardUpdate ();
+        }
+        parts[shard]->units.insert (name);
+        if (previous != old.end ()) {
+            for (auto &device : previous->second) {
+                route (symbol (device), shard, false);
+            }
+        }
+        if (next != now.end ()) {
+            for (auto &device : next->second) {
+                route (symbol (device), shard, true);
+            }
+            (parts[shard]->changed.*kind).insert (*next);
+        }
+    };
+    for (auto &name : units) {
+        move (name, before.racks, changed.racks, &TPowerTopology::racks);
+        move (name, before.DCs, changed.DCs, &TPowerTopology::DCs);
+    }
+    // only shards owning some of the units
+    for (size_t i = 0; i < size (); ++i) {
+        if (parts[i]) {
+            zsock_send (_actors[i], "sp", "UPDATE", parts[i]);
+        }
+    }
+}
+
+void TPowerShards::
+    route (Symbol device, size_t shard, bool add)
+{
+    auto &owners = _owners[device];
+    if (add) {
+        owners.push_back (static_cast<uint8_t> (shard));
+    }
+    else {
+        auto owner = std::find (owners.begin (), owners.end (), shard);
+        if (owner != owners.end ()) {
+            owners.erase (owner);
+        }
+    }
+    if (owners.empty ()) {
+        _owners.erase (device);
+        _routes.erase (device);
+        return;
+    }
+    uint64_t bits = 0;
+    for (auto owner : owners) {
+        bits |= UINT64_C (1) << owner;
+    }
+    _routes[device] = bits;
+}
+
+void TPowerShards::
+    publishPolicies (const TPowerPublishPolicies &policies)
+{
+    for (auto &actor : _actors) {
+        zsock_send (actor, "sp", "POLICIES", new TPowerPublishPolicies (policies));
+    }
+}
+
+void TPowerShards::
+    processMetric (const MetricInfo &M, TPowerQuantity quantity)
+{
+    auto route = _routes.find (M.getElementId ());
+    if (route == _routes.end ()) {
+        return;
+    }
+    for (size_t i = 0; i < size (); ++i) {
+        if (route->second & (UINT64_C (1) << i)) {
+            _pending[i].emplace_back (quantity, M);
+        }
+    }
+}
+
+void TPowerShards::
+    notPublished (const MetricInfo &M)
+{
+    _notSent[shardOf (M.getElementName (), size ())].push_back (M);
+}
+
+void TPowerShards::
+    flush (void)
+{
+    for (size_t i = 0; i < size (); ++i) {
+        if (!_pending[i].empty ()) {
+            TPowerShardBatch *batch = new TPowerShardBatch ();
+            batch->swap (_pending[i]);
+            zsock_send (_actors[i], "sp", "METRICS", batch);
+        }
+        if (!_notSent[i].empty ()) {
+            std::vector<MetricInfo> *metrics = new std::vector<MetricInfo> ();
+            metrics->swap (_notSent[i]);
+            zsock_send (_actors[i], "sp", "NOTSENT", metrics);
+        }
+    }
+}
+
+bool TPowerShards::
+    receivePublished (zactor_t *actor, std::vector<MetricInfo> &metrics)
+{
+    zmsg_t *msg = zmsg_recv (actor);
+    if (!msg) {
+        return false;
+    }
+    return s_popPublished (&msg, metrics);
+}
+
+size_t TPowerShards::
+    shardOf (const std::string &unit, size_t count)
+{
+    return std::hash<std::string> () (unit) % count;
+}
+
+void
+tpowershards_actor (zsock_t *pipe, void *args)
+{
+    // metrics are published by the agent actor, which returns the metrics
+    // it failed to send (NOTSENT)
+    std::vector<MetricInfo> published;
+    TotalPowerConfiguration config ([&published] (const MetricInfo &M) -> bool {
+        published.push_back (M);
+        return true;
+    });
+    if (args) {
+        config.batchingWindow (*static_cast<int64_t *> (args));
+    }
+
+    zpoller_t *poller = zpoller_new (pipe, NULL);
+    zsock_signal (pipe, 0);
+
+    uint64_t last = zclock_mono ();
+    bool terminate = false;
+    while (!terminate && !zsys_interrupted) {
+        void *which = zpoller_wait (poller, config.getTimeout ());
+        if (zpoller_terminated (poller)) {
+            break;
+        }
+        if (which == pipe) {
+            zmsg_t *msg = zmsg_recv (pipe);
+            char *command = zmsg_popstr (msg);
+            terminate = !command || streq (command, "$TERM");
+            if (command && streq (command, "TOPOLOGY")) {
+                std::unique_ptr<TPowerTopology> topology (
+                    static_cast<TPowerTopology *> (s_popPointer (msg)));
+                if (topology) {
+                    config.configure (*topology);
+                }
+            }
+            else
+            if (command && streq (command, "UPDATE")) {
+                std::unique_ptr<TPowerShardUpdate> update (
+                    static_cast<TPowerShardUpdate *> (s_popPointer (msg)));
+                if (update) {
+                    config.update (update->units, update->changed);
+                }
+            }
+            else
+            if (command && streq (command, "POLICIES")) {
+                std::unique_ptr<TPowerPublishPolicies> policies (
+                    static_cast<TPowerPublishPolicies *> (s_popPointer (msg)));
+                if (policies) {
+                    config.publishPolicies (*policies);
+                }
+            }
+            else
+            if (command && streq (command, "METRICS")) {
+                std::unique_ptr<TPowerShardBatch> batch (
+                    static_cast<TPowerShardBatch *> (s_popPointer (msg)));
+                if (batch) {
+                    for (auto &metric : *batch) {
+                        config.processMetric (metric.second, metric.first);
+                    }
+                }
+            }
+            else
+            if (command && streq (command, "NOTSENT")) {
+                std::unique_ptr< std::vector<MetricInfo> > metrics (
+                    static_cast< std::vector<MetricInfo> * > (s_popPointer (msg)));
+                if (metrics) {
+                    for (auto &M : *metrics) {
+                        config.notPublished (M);
+                    }
+                }
+            }
+            else
+            if (!terminate) {
+                log_info ("unhandled shard command %s", command);
+            }
+            zstr_free (&command);
+            zmsg_destroy (&msg);
+        }
+
+        uint64_t now = zclock_mono ();
+        if (now - last >= static_cast<uint64_t> (config.getTimeout ())) {
+            last = now;
+            config.onPoll ();
+        }
+        if (!published.empty ()) {
+            std::vector<MetricInfo> *metrics = new std::vector<MetricInfo> ();
+            metrics->swap (published);
+            zsock_send (pipe, "sp", "PUBLISH", metrics);
+        }
+    }
+    zpoller_destroy (&poller);
+    if (terminate) {
+        // owner reads all PUBLISH messages up to this signal, then waits
+        // for the final one in zactor_destroy
+        zsock_signal (pipe, 0);
+        while (true) {
+            zmsg_t *msg = zmsg_recv (pipe);
+            char *command = msg ? zmsg_popstr (msg) : NULL;
+            bool done = !command || streq (command, "$TERM");
+            zstr_free (&command);
+            zmsg_destroy (&msg);
+            if (done) {
+                break;
+            }
+        }
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+tpowershards_test (bool verbose)
+{
+    printf (" * tpowershards: ");
+
+    assert (TPowerShards::shardOf ("rack-shards-test", 1) == 0);
+    assert (TPowerShards::shardOf ("rack-shards-test", 4) < 4);
+
+    {
+        TPowerShards shards (2);
+        assert (shards.size () == 2);
+
+        TPowerTopology topology;
+        topology.racks["rack-shards-test"] = { "ups-shards-test" };
+        topology.DCs["dc-shards-test"] = { "ups-shards-test" };
+        shards.configure (topology);
+
+        uint64_t now = ::time (NULL);
+        shards.processMetric (
+            MetricInfo ("ups-shards-test", "realpower.default", "W", 100, now, "", 300),
+            TPOWER_REALPOWER_DEFAULT);
+        // powerdevice out of topology is not routed anywhere
+        shards.processMetric (
+            MetricInfo ("epdu-shards-test", "realpower.default", "W", 50, now, "", 300),
+            TPOWER_REALPOWER_DEFAULT);
+        shards.flush ();
+
+        // both rack and DC get their total, wherever they are
+        std::vector<MetricInfo> published;
+        zpoller_t *poller = zpoller_new (NULL);
+        for (size_t i = 0; i < shards.size (); ++i) {
+            zpoller_add (poller, shards.actor (i));
+        }
+        while (published.size () < 2) {
+            void *which = zpoller_wait (poller, 5000);
+            assert (which);
+            assert (TPowerShards::receivePublished (static_cast<zactor_t *> (which), published));
+        }
+        zpoller_destroy (&poller);
+
+        assert (published.size () == 2);
+        for (auto &M : published) {
+            assert (M.getElementName () == "rack-shards-test" || M.getElementName () == "dc-shards-test");
+            assert (M.getSource () == "realpower.default");
+            assert (M.getValue () == 100);
+        }
+        assert (published[0].getElementName () != published[1].getElementName ());
+
+        // metric, which was not sent, is published again by its shard
+        for (auto &M : published) {
+            if (M.getElementName () == "rack-shards-test") {
+                shards.notPublished (M);
+            }
+        }
+        shards.flush ();
+        std::vector<MetricInfo> again;
+        size_t shard = TPowerShards::shardOf ("rack-shards-test", shards.size ());
+        zpoller_t *rack = zpoller_new (shards.actor (shard), NULL);
+        while (again.empty ()) {
+            assert (zpoller_wait (rack, 5000));
+            assert (TPowerShards::receivePublished (shards.actor (shard), again));
+        }
+        zpoller_destroy (&rack);
+        assert (again.size () == 1);
+        assert (again[0].getElementName () == "rack-shards-test");
+        assert (again[0].getValue () == 100);
+
+        // changed rack is updated by its shard, metrics are routed by its new powerdevices
+        TPowerTopology before;
+        before.racks["rack-shards-test"] = { "ups-shards-test" };
+        TPowerTopology changed;
+        changed.racks["rack-shards-test"] = { "epdu-shards-test" };
+        shards.update ({ "rack-shards-test" }, before, changed);
+        shards.processMetric (
+            MetricInfo ("epdu-shards-test", "realpower.default", "W", 50, ::time (NULL), "", 300),
+            TPOWER_REALPOWER_DEFAULT);
+        shards.flush ();
+        std::vector<MetricInfo> updated;
+        rack = zpoller_new (shards.actor (shard), NULL);
+        while (updated.empty ()) {
+            assert (zpoller_wait (rack, 5000));
+            assert (TPowerShards::receivePublished (shards.actor (shard), updated));
+        }
+        zpoller_destroy (&rack);
+        assert (updated.size () == 1);
+        assert (updated[0].getElementName () == "rack-shards-test");
+        assert (updated[0].getValue () == 50);
+    }
+    printf ("OK\n");
+}
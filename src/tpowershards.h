@@ -0,0 +1,138 @@
+/*  =========================================================================
+    tpowershards - Sharded aggregation in worker actors
+
+    Copyright (C) 2014 - 2018 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*! \file   tpowershards.h
+ *  \brief  Racks and DCs partitioned across worker actors
+ */
+
+#ifndef SRC_TPOWERSHARDS_H_
+#define SRC_TPOWERSHARDS_H_
+
+#include <czmq.h>
+#include <vector>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "tpowerconfiguration.h"
+
+//! \brief metrics for one shard: quantity and measurement
+typedef std::vector< std::pair<TPowerQuantity, MetricInfo> > TPowerShardBatch;
+
+//! \brief change of some units of one shard, see TotalPowerConfiguration::update()
+struct TPowerShardUpdate {
+    std::set<std::string> units;
+    TPowerTopology changed;
+};
+
+/*
+ * \brief Racks and DCs partitioned across worker actors
+ *
+ * Every worker owns its own TotalPowerConfiguration with the units of its
+ * partition. Metrics are queued per shard by the agent actor and passed to
+ * the workers by pointer over the actor pipes, once per flush(). Every
+ * topology is split and sent to all workers at once, so a worker never
+ * sees metrics routed by a different topology than the one it has. Change
+ * of some units goes only to the workers owning them.
+ *
+ * Workers don't publish, they send PUBLISH message with the computed
+ * metrics back over the pipe, see receivePublished(). Units are marked as
+ * advertised by the worker, metrics, which the agent fails to send, must
+ * be returned by notPublished(), so the worker advertises them again.
+ */
+class TPowerShards {
+public:
+    //! \brief maximal number of shards (a device can be routed to each of them)
+    static const size_t MAX_SHARDS = 64;
+
+    explicit TPowerShards (size_t count, int64_t batchingWindow = TPOWER_BATCHING_WINDOW);
+    ~TPowerShards ();
+
+    //! \brief number of shards
+    size_t size (void) const {
+        return _actors.size ();
+    };
+
+    //! \brief actor of the shard, it is readable, when it has metrics to publish
+    zactor_t *actor (size_t shard) const {
+        return _actors[shard];
+    };
+
+    //! \brief split topology by racks and DCs and send it to all shards
+    void configure (const TPowerTopology &topology);
+    /*
+     * \brief Send change of units to the shards owning them
+     *
+     * \param units - names of changed units
+     * \param before - powerdevices of the units before the change
+     * \param changed - powerdevices of the units, which still exist
+     */
+    void update (
+        const std::set<std::string> &units,
+        const TPowerTopology &before,
+        const TPowerTopology &changed);
+
+    //! \brief send publish policies to all shards, they apply to the next topology as well
+    void publishPolicies (const TPowerPublishPolicies &policies);
+
+    //! \brief queue metric for all shards owning a unit powered by the device
+    void processMetric (const MetricInfo &M, TPowerQuantity quantity);
+
+    //! \brief return metric, which was not sent, to the shard owning its unit (sent by flush())
+    void notPublished (const MetricInfo &M);
+
+    //! \brief pass queued metrics and metrics, which were not sent, to the shards
+    void flush (void);
+
+    /*
+     * \brief Receive metrics computed by shard
+     *
+     * \return true if PUBLISH message was received, metrics are appended
+     */
+    static bool receivePublished (zactor_t *actor, std::vector<MetricInfo> &metrics);
+
+    //! \brief shard, which owns the unit
+    static size_t shardOf (const std::string &unit, size_t count);
+
+private:
+    TPowerShards (const TPowerShards &) = delete;
+    //! \brief add or remove one unit of the shard to the route of the powerdevice
+    void route (Symbol device, size_t shard, bool add);
+    TPowerShards &operator= (const TPowerShards &) = delete;
+
+    std::vector<zactor_t *> _actors;
+    //! \brief powerdevice -> shards (bit per shard) owning units it powers
+    std::unordered_map< Symbol, uint64_t > _routes;
+    //! \brief powerdevice -> shard of every unit it powers
+    std::unordered_map< Symbol, std::vector<uint8_t> > _owners;
+    //! \brief queued metrics per shard
+    std::vector<TPowerShardBatch> _pending;
+    //! \brief metrics, which were not sent, per shard
+    std::vector< std::vector<MetricInfo> > _notSent;
+};
+
+//! \brief actor of one shard
+void tpowershards_actor (zsock_t *pipe, void *args);
+
+void tpowershards_test (bool verbose);
+
+#endif // SRC_TPOWERSHARDS_H_